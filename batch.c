@@ -0,0 +1,371 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "nes.h"
+#include "hash.h"
+
+// manifest lines: <rom.nes> <frames> [input log], blank lines and # comments are skipped
+// input log lines: <joypad1 hex> [joypad2 hex], one per frame, the last one holds
+
+typedef struct BatchJob
+{
+    char            *rom, *input;
+    unsigned int    frames;
+
+    // filled in by the worker that ran the job
+    uint64_t        ram_hash, frame_hash, state_hash;
+    double          ms;
+    int             worker;
+    bool            ok;
+} BatchJob;
+
+typedef struct Worker
+{
+    // next job in the low half, one past the last in the high half, owner
+    // takes from the front and thieves from the back
+    _Atomic uint64_t    range;
+    pthread_t           thread;
+    int                 id;
+
+    struct Batch        *batch;
+} Worker;
+
+typedef struct Batch
+{
+    BatchJob        *jobs;
+    unsigned int    job_count;
+
+    Worker          *workers;
+    int             worker_count;
+} Batch;
+
+static bool worker_take(Worker *worker, bool steal, unsigned int *job)
+{
+    uint64_t range = atomic_load(&worker->range);
+
+    while (true)
+    {
+        uint32_t    next = range & 0xFFFFFFFF,
+                    end = range >> 32;
+
+        if (next >= end)
+            return false;
+
+        uint64_t taken = steal ? ((uint64_t)(end - 1) << 32) | next 
+                                : ((uint64_t)end << 32) | (next + 1);
+
+        if (atomic_compare_exchange_weak(&worker->range, &range, taken))
+        {
+            *job = steal ? end - 1 : next;
+            return true;
+        }
+    }
+}
+
+static bool batch_next_job(Worker *worker, unsigned int *job)
+{
+    Batch *batch = worker->batch;
+
+    if (worker_take(worker, false, job))
+        return true;
+
+    // out of work, take from the back of the others' ranges
+    for (int i = 1; i < batch->worker_count; i++)
+    {
+        Worker *victim = &batch->workers[(worker->id + i) % batch->worker_count];
+
+        if (worker_take(victim, true, job))
+            return true;
+    }
+
+    return false;
+}
+
+static unsigned short *load_input(const char *filename, unsigned int *length)
+{
+    FILE *f = fopen(filename, "r");
+
+    if (!f)
+    {
+        fprintf(stderr, "Could not open input log %s!\n", filename);
+        return NULL;
+    }
+
+    unsigned int    capacity = 1024,
+                    count = 0,
+                    joypad1,
+                    joypad2;
+
+    unsigned short  *input = malloc(capacity * sizeof(unsigned short));
+    char            line[64];
+
+    while (fgets(line, sizeof(line), f))
+    {
+        int fields = sscanf(line, "%x %x", &joypad1, &joypad2);
+
+        if (fields < 1)
+            continue;
+
+        if (fields < 2)
+            joypad2 = 0;
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            input = realloc(input, capacity * sizeof(unsigned short));
+        }
+
+        input[count++] = (joypad1 & 0xFF) | (joypad2 & 0xFF) << 8;
+    }
+
+    fclose(f);
+
+    *length = count;
+    return input;
+}
+
+static void run_job(NesMachine *nes, const char **loaded, BatchJob *job)
+{
+    unsigned short  *input = NULL;
+    unsigned int    input_length = 0;
+
+    // a worker keeps its machine and only reloads when the rom changes,
+    // switching it off and on so no job sees what the last one left
+    if (*loaded && !strcmp(*loaded, job->rom))
+        nes_power_cycle(nes);
+    else if (nes_load_file(nes, job->rom))
+        *loaded = job->rom;
+    else
+    {
+        *loaded = NULL;
+        return;
+    }
+
+    if (job->input && !(input = load_input(job->input, &input_length)))
+        return;
+
+    for (unsigned int n = 0; n < job->frames; n++)
+    {
+        if (input_length)
+        {
+            unsigned short buttons = input[n < input_length ? n : input_length - 1];
+
+            nes_set_buttons(nes, buttons & 0xFF, buttons >> 8);
+        }
+
+        nes_step(nes, n + 1 == job->frames);
+    }
+
+    job->ram_hash = hash_xxh64(nes_cpu(nes)->bus.cpu_vram, 2048, 0);
+    job->frame_hash = hash_xxh64(nes_frame(nes)->data, sizeof(Frame), 0);
+    // everything else, cart ram and sound included
+    job->state_hash = nes_state_hash(nes);
+    job->ok = true;
+
+    free(input);
+}
+
+static void *worker_run(void *data)
+{
+    Worker          *worker = data;
+    NesMachine      *nes = nes_create();
+    const char      *loaded = NULL;
+    unsigned int    idx;
+
+    while (batch_next_job(worker, &idx))
+    {
+        BatchJob *job = &worker->batch->jobs[idx];
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_job(nes, &loaded, job);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        job->ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        job->worker = worker->id;
+    }
+
+    nes_destroy(nes);
+    return NULL;
+}
+
+static bool load_manifest(Batch *batch, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+
+    if (!f)
+    {
+        fprintf(stderr, "Could not open manifest %s!\n", filename);
+        return false;
+    }
+
+    unsigned int    capacity = 64;
+    char            line[1024], rom[512], input[512];
+
+    batch->jobs = malloc(capacity * sizeof(BatchJob));
+    batch->job_count = 0;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned int    frames;
+        int             fields = sscanf(line, "%511s %u %511s", rom, &frames, input);
+
+        if (fields < 1 || rom[0] == '#')
+            continue;
+
+        if (fields < 2)
+        {
+            fprintf(stderr, "manifest: missing frame count for %s\n", rom);
+            continue;
+        }
+
+        if (batch->job_count == capacity)
+        {
+            capacity *= 2;
+            batch->jobs = realloc(batch->jobs, capacity * sizeof(BatchJob));
+        }
+
+        BatchJob *job = &batch->jobs[batch->job_count++];
+
+        memset(job, 0, sizeof(BatchJob));
+        job->rom = strdup(rom);
+        job->input = fields > 2 ? strdup(input) : NULL;
+        job->frames = frames;
+    }
+
+    fclose(f);
+    return true;
+}
+
+// as a json string, quotes included
+static void write_string(const char *s, FILE *out)
+{
+    fputc('"', out);
+
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+
+    fputc('"', out);
+}
+
+static void write_results(const Batch *batch, FILE *out)
+{
+    for (unsigned int i = 0; i < batch->job_count; i++)
+    {
+        const BatchJob *job = &batch->jobs[i];
+
+        fprintf(out, "{\"job\":%u,\"rom\":", i);
+        write_string(job->rom, out);
+        fprintf(out, ",\"frames\":%u,\"ok\":%s,", job->frames, job->ok ? "true" : "false");
+
+        if (job->ok)
+            fprintf(out, "\"ram_hash\":\"%016llx\",\"frame_hash\":\"%016llx\",\"state_hash\":\"%016llx\",", 
+                    (unsigned long long)job->ram_hash, (unsigned long long)job->frame_hash, 
+                    (unsigned long long)job->state_hash);
+
+        fprintf(out, "\"ms\":%.3f,\"worker\":%d}\n", job->ms, job->worker);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char  *manifest = NULL, 
+                *out_file = NULL;
+
+    int         threads = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_file = argv[++i];
+        else if (!manifest)
+            manifest = argv[i];
+        else
+        {
+            manifest = NULL;
+            break;
+        }
+    }
+
+    if (!manifest)
+    {
+        printf("usage: nes_batch <manifest> [-j threads] [-o results.jsonl]\n");
+        return 1;
+    }
+
+    Batch batch;
+
+    if (!load_manifest(&batch, manifest))
+        return 1;
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads > (int)batch.job_count)
+        threads = batch.job_count ? batch.job_count : 1;
+
+    batch.worker_count = threads;
+    batch.workers = calloc(threads, sizeof(Worker));
+
+    // every worker starts with an even slice of the manifest
+    for (int i = 0; i < threads; i++)
+    {
+        uint64_t    next = (uint64_t)batch.job_count * i / threads,
+                    end = (uint64_t)batch.job_count * (i + 1) / threads;
+
+        batch.workers[i].id = i;
+        batch.workers[i].batch = &batch;
+        atomic_init(&batch.workers[i].range, end << 32 | next);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < threads; i++)
+        pthread_create(&batch.workers[i].thread, NULL, worker_run, &batch.workers[i]);
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(batch.workers[i].thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    FILE *out = out_file ? fopen(out_file, "w") : stdout;
+
+    if (!out)
+    {
+        fprintf(stderr, "Could not open %s for writing!\n", out_file);
+        out = stdout;
+    }
+
+    write_results(&batch, out);
+
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "%u jobs on %d workers in %.3f s\n", batch.job_count, threads, seconds);
+
+    for (unsigned int i = 0; i < batch.job_count; i++)
+    {
+        free(batch.jobs[i].rom);
+        free(batch.jobs[i].input);
+    }
+
+    free(batch.jobs);
+    free(batch.workers);
+
+    return 0;
+}
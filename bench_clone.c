@@ -0,0 +1,130 @@
+#include <time.h>
+#include "nes.h"
+#include "clone.h"
+#include "state.h"
+
+#define BENCH_CLONES    20000
+#define BENCH_CHECKS    64
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+    uintptr_t   x = (uintptr_t)*(ClonePage* const*)a,
+                y = (uintptr_t)*(ClonePage* const*)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("usage: bench_clone <rom.nes>\n");
+        return 1;
+    }
+
+    NesMachine *nes = nes_create();
+
+    if (!nes_load_file(nes, argv[1]))
+    {
+        nes_destroy(nes);
+        return 1;
+    }
+
+    for (int n = 0; n < 120; n++)
+        nes_step(nes, false);
+
+    NesClone        **clones = malloc((BENCH_CLONES + 1) * sizeof(NesClone*));
+    uint8_t         (*states)[STATE_MAX_SIZE] = malloc(BENCH_CHECKS * STATE_MAX_SIZE);
+    size_t          state_lengths[BENCH_CHECKS];
+    double          clone_time = 0, 
+                    restore_time = 0;
+
+    unsigned int    seed = 1;
+    struct timespec start;
+
+    clones[0] = nes_clone(nes);
+
+    // grow a random tree: restore a node, play one frame, clone the result
+    for (int n = 1; n <= BENCH_CLONES; n++)
+    {
+        seed = seed * 1103515245 + 12345;
+
+        NesClone *parent = clones[(seed >> 8) % n];
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        nes_restore(nes, parent);
+        restore_time += seconds_since(&start);
+
+        nes_set_buttons(nes, seed >> 16, 0);
+        nes_step(nes, false);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        clones[n] = nes_clone(nes);
+        clone_time += seconds_since(&start);
+
+        if (n <= BENCH_CHECKS)
+            state_lengths[n - 1] = nes_save_state(nes, states[n - 1], STATE_MAX_SIZE);
+    }
+
+    // every page is counted once however many clones share it
+    size_t      page_count = 0;
+    ClonePage   **pages = malloc((BENCH_CLONES + 1) * 25 * sizeof(ClonePage*));
+
+    for (int n = 0; n <= BENCH_CLONES; n++)
+    {
+        for (int i = 0; i < 8; i++)
+            pages[page_count++] = clones[n]->ram[i];
+
+        for (int i = 0; i < 16; i++)
+            pages[page_count++] = clones[n]->vram[i];
+
+        pages[page_count++] = clones[n]->oam;
+    }
+
+    qsort(pages, page_count, sizeof(ClonePage*), compare_pages);
+
+    size_t unique = page_count ? 1 : 0;
+
+    for (size_t i = 1; i < page_count; i++)
+        unique += pages[i] != pages[i - 1];
+
+    // restoring an early clone has to give back exactly the state it was taken from
+    int     mismatches = 0;
+    uint8_t state[STATE_MAX_SIZE];
+
+    for (int n = BENCH_CHECKS; n >= 1; n--)
+    {
+        nes_restore(nes, clones[n]);
+
+        size_t length = nes_save_state(nes, state, STATE_MAX_SIZE);
+
+        if (length != state_lengths[n - 1] || memcmp(state, states[n - 1], length))
+            mismatches++;
+    }
+
+    double bytes = (double)(BENCH_CLONES + 1) * sizeof(NesClone) + unique * sizeof(ClonePage);
+
+    printf("%d clones: %.0f clones/s, %.0f restores/s\n", 
+            BENCH_CLONES, BENCH_CLONES / clone_time, BENCH_CLONES / restore_time);
+    printf("%zu unique pages of %zu, %.0f bytes per clone (a full save state is %zu)\n", 
+            unique, page_count, bytes / (BENCH_CLONES + 1), state_lengths[0]);
+    printf("%d of %d restored states differ\n", mismatches, BENCH_CHECKS);
+
+    for (int n = 0; n <= BENCH_CLONES; n++)
+        nes_clone_free(clones[n]);
+
+    free(pages);
+    free(states);
+    free(clones);
+    nes_destroy(nes);
+
+    return mismatches ? 1 : 0;
+}
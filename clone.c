@@ -0,0 +1,290 @@
+#include "clone.h"
+#include "mapper.h"
+
+// the live machine keeps its memory in place; Bus.dirty_pages and
+// PPU.dirty_pages say which pages changed since the clone it was last
+// taken from or restored to (its base), every other page is still the
+// same as the base's and is shared instead of copied
+
+static ClonePage *page_share(ClonePage *page)
+{
+    atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+    return page;
+}
+
+static ClonePage *page_copy(const uint8_t *data)
+{
+    ClonePage *page = malloc(sizeof(ClonePage));
+
+    if (!page)
+        return NULL;
+
+    atomic_init(&page->refs, 1);
+    memcpy(page->data, data, CLONE_PAGE_SIZE);
+
+    return page;
+}
+
+static void page_release(ClonePage *page)
+{
+    if (page && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1)
+        free(page);
+}
+
+static ClonePage *clone_page(ClonePage *base, bool dirty, const uint8_t *data)
+{
+    return base && !dirty ? page_share(base) : page_copy(data);
+}
+
+// false when a page could not be allocated
+static bool clone_complete(const NesClone *clone, const Bus *bus, const PPU *ppu)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        if (!clone->ram[i])
+            return false;
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (!clone->vram[i])
+            return false;
+    }
+
+    if (!clone->oam)
+        return false;
+
+    // cart ram pages are only left out when the cart has none
+    for (int i = 0; i < 32; i++)
+    {
+        if ((ppu->chr_ram && !clone->chr_ram[i]) || (bus->rom.prg_ram && !clone->prg_ram[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static void clone_cart_ram(ClonePage *pages[32], ClonePage *const base[32], uint32_t dirty, const uint8_t *data)
+{
+    for (int i = 0; i < 32; i++)
+        pages[i] = data ? clone_page(base ? base[i] : NULL, dirty & ((uint32_t)1 << i), &data[i * CLONE_PAGE_SIZE]) : NULL;
+}
+
+static bool restore_cart_ram(uint8_t *data, ClonePage *const pages[32], ClonePage *const base[32], uint32_t dirty)
+{
+    bool changed = false;
+
+    for (int i = 0; data && i < 32; i++)
+    {
+        if (base && !(dirty & ((uint32_t)1 << i)) && base[i] == pages[i])
+            continue;
+
+        memcpy(&data[i * CLONE_PAGE_SIZE], pages[i]->data, CLONE_PAGE_SIZE);
+        changed = true;
+    }
+
+    return changed;
+}
+
+NesClone *clone_take(CPU *cpu, const NesClone *base)
+{
+    Bus         *bus = &cpu->bus;
+    PPU         *ppu = &bus->ppu;
+    NesClone    *clone = calloc(1, sizeof(NesClone));
+
+    if (!clone)
+        return NULL;
+
+    atomic_init(&clone->refs, 1);
+
+    for (int i = 0; i < 8; i++)
+        clone->ram[i] = clone_page(base ? base->ram[i] : NULL, 
+                                    bus->dirty_pages & (1 << i), 
+                                    &bus->cpu_vram[i * CLONE_PAGE_SIZE]);
+
+    for (int i = 0; i < 16; i++)
+        clone->vram[i] = clone_page(base ? base->vram[i] : NULL, 
+                                    ppu->dirty_pages & (1 << i), 
+                                    &ppu->vram[i * CLONE_PAGE_SIZE]);
+
+    clone->oam = clone_page(base ? base->oam : NULL, ppu->dirty_pages & PPU_OAM_PAGE, ppu->oam_data);
+
+    clone_cart_ram(clone->chr_ram, base ? base->chr_ram : NULL, ppu->chr_dirty_pages, ppu->chr_ram);
+    clone_cart_ram(clone->prg_ram, base ? base->prg_ram : NULL, bus->prg_ram_dirty_pages, bus->rom.prg_ram);
+
+    // the pages that were taken go back, and the dirty bits stay for the next try
+    if (!clone_complete(clone, bus, ppu))
+    {
+        clone_release(clone);
+        return NULL;
+    }
+
+    bus->dirty_pages = 0;
+    bus->prg_ram_dirty_pages = 0;
+    ppu->dirty_pages = 0;
+    ppu->chr_dirty_pages = 0;
+
+    clone->register_a = cpu->register_a;
+    clone->register_x = cpu->register_x;
+    clone->register_y = cpu->register_y;
+    clone->stack_pointer = cpu->stack_pointer;
+    clone->status = cpu->status;
+    clone->program_counter = cpu->program_counter;
+    clone->cycles = cpu->cycles;
+    clone->bus_cycles = bus->cycles;
+
+    clone->joypad1 = bus->joypad1;
+    clone->joypad2 = bus->joypad2;
+
+    clone->ctrl = ppu->ctrl;
+    clone->mask = ppu->mask;
+    clone->ppu_status = ppu->status;
+    clone->oam_addr = ppu->oam_addr;
+    clone->internal_data_buf = ppu->internal_data_buf;
+    clone->latch = ppu->latch;
+    clone->x = ppu->x;
+    clone->nmi_interrupt = ppu->nmi_interrupt;
+    clone->nmi_write = ppu->nmi_write;
+    clone->w = ppu->w;
+    clone->sprite_no_limit = ppu->sprite_no_limit;
+    clone->mirroring = ppu->mirroring;
+    clone->scanline = ppu->scanline;
+    clone->ppu_cycles = ppu->cycles;
+    clone->v = ppu->v;
+    clone->t = ppu->t;
+    clone->sprite_0_hit_dot = ppu->sprite_0_hit_dot;
+
+    memcpy(clone->palette_table, ppu->palette_table, sizeof(clone->palette_table));
+    memcpy(clone->sprite_y, ppu->sprite_y, sizeof(clone->sprite_y));
+    clone->sprite_height = ppu->sprite_height;
+    memcpy(clone->scanlines, ppu->scanlines, sizeof(clone->scanlines));
+
+    clone->apu = bus->apu;
+    clone->mapper = bus->mapper;
+
+    return clone;
+}
+
+void clone_restore(CPU *cpu, const NesClone *clone, const NesClone *base)
+{
+    Bus     *bus = &cpu->bus;
+    PPU     *ppu = &bus->ppu;
+    bool    vram_changed = false;
+
+    // only pages written since the base or held differently by the clone are copied
+    for (int i = 0; i < 8; i++)
+    {
+        if (!base || bus->dirty_pages & (1 << i) || base->ram[i] != clone->ram[i])
+            memcpy(&bus->cpu_vram[i * CLONE_PAGE_SIZE], clone->ram[i]->data, CLONE_PAGE_SIZE);
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (base && !(ppu->dirty_pages & (1 << i)) && base->vram[i] == clone->vram[i])
+            continue;
+
+        memcpy(&ppu->vram[i * CLONE_PAGE_SIZE], clone->vram[i]->data, CLONE_PAGE_SIZE);
+        vram_changed = true;
+
+        // the last page of each nametable holds its attribute bytes
+        if ((i & 3) == 3)
+        {
+            for (unsigned short idx = (i << 8) | 0xC0; idx < (i + 1) << 8; idx++)
+                ppu_update_attribute(ppu, idx);
+        }
+    }
+
+    if (!base || ppu->dirty_pages & PPU_OAM_PAGE || base->oam != clone->oam)
+        memcpy(ppu->oam_data, clone->oam->data, CLONE_PAGE_SIZE);
+
+    // patterns feed the cached background the same way nametables do
+    if (restore_cart_ram(ppu->chr_ram, clone->chr_ram, base ? base->chr_ram : NULL, ppu->chr_dirty_pages))
+        vram_changed = true;
+
+    restore_cart_ram(bus->rom.prg_ram, clone->prg_ram, base ? base->prg_ram : NULL, bus->prg_ram_dirty_pages);
+
+    bus->dirty_pages = 0;
+    bus->prg_ram_dirty_pages = 0;
+    ppu->dirty_pages = 0;
+    ppu->chr_dirty_pages = 0;
+
+    cpu->register_a = clone->register_a;
+    cpu->register_x = clone->register_x;
+    cpu->register_y = clone->register_y;
+    cpu->stack_pointer = clone->stack_pointer;
+    cpu->status = clone->status;
+    cpu->program_counter = clone->program_counter;
+    cpu->cycles = clone->cycles;
+    bus->cycles = clone->bus_cycles;
+
+    bus->joypad1 = clone->joypad1;
+    bus->joypad2 = clone->joypad2;
+
+    ppu->ctrl = clone->ctrl;
+    ppu->mask = clone->mask;
+    ppu->status = clone->ppu_status;
+    ppu->oam_addr = clone->oam_addr;
+    ppu->internal_data_buf = clone->internal_data_buf;
+    ppu->latch = clone->latch;
+    ppu->x = clone->x;
+    ppu->nmi_interrupt = clone->nmi_interrupt;
+    ppu->nmi_write = clone->nmi_write;
+    ppu->w = clone->w;
+    ppu->sprite_no_limit = clone->sprite_no_limit;
+    ppu->scanline = clone->scanline;
+    ppu->cycles = clone->ppu_cycles;
+    ppu->v = clone->v;
+    ppu->t = clone->t;
+    ppu->sprite_0_hit_dot = clone->sprite_0_hit_dot;
+
+    memcpy(ppu->palette_table, clone->palette_table, sizeof(ppu->palette_table));
+    memcpy(ppu->sprite_y, clone->sprite_y, sizeof(ppu->sprite_y));
+    ppu->sprite_height = clone->sprite_height;
+    memcpy(ppu->scanlines, clone->scanlines, sizeof(ppu->scanlines));
+
+    bus->apu = clone->apu;
+
+    // switching the windows back only redraws the banks that changed
+    bus->mapper = clone->mapper;
+    mapper_apply(bus);
+
+    if (ppu->mirroring != clone->mirroring)
+        ppu_set_mirroring(ppu, clone->mirroring);
+    else if (vram_changed)
+        ppu_invalidate_background(ppu);
+
+    ppu_evaluate_sprite_lines(ppu);
+}
+
+NesClone *clone_retain(NesClone *clone)
+{
+    if (clone)
+        atomic_fetch_add_explicit(&clone->refs, 1, memory_order_relaxed);
+
+    return clone;
+}
+
+void clone_release(NesClone *clone)
+{
+    if (!clone || atomic_fetch_sub_explicit(&clone->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    for (int i = 0; i < 8; i++)
+        page_release(clone->ram[i]);
+
+    for (int i = 0; i < 16; i++)
+        page_release(clone->vram[i]);
+
+    page_release(clone->oam);
+
+    for (int i = 0; i < 32; i++)
+    {
+        if (clone->chr_ram[i])
+            page_release(clone->chr_ram[i]);
+
+        if (clone->prg_ram[i])
+            page_release(clone->prg_ram[i]);
+    }
+
+    free(clone);
+}
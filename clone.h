@@ -0,0 +1,53 @@
+#ifndef CLONE_H
+#define CLONE_H
+
+#include <stdatomic.h>
+#include "emu.h"
+
+#define CLONE_PAGE_SIZE     256
+
+typedef struct ClonePage
+{
+    atomic_int      refs;
+    uint8_t         data[CLONE_PAGE_SIZE];
+} ClonePage;
+
+// a machine state whose memory pages are shared with the clones it was
+// taken after for as long as neither side writes them
+typedef struct NesClone
+{
+    atomic_int          refs;
+
+    ClonePage           *ram[8], *vram[16], *oam;
+
+    // NULL on carts without chr or prg ram
+    ClonePage           *chr_ram[32], *prg_ram[32];
+
+    // everything else is small enough to copy outright
+    uint8_t             register_a, register_x, register_y, stack_pointer;
+    enum ProcessorStatus status;
+    uint16_t            program_counter;
+    unsigned int        cycles, bus_cycles;
+
+    Joypad              joypad1, joypad2;
+
+    uint8_t             ctrl, mask, ppu_status, oam_addr, internal_data_buf, latch, x;
+    bool                nmi_interrupt:1, nmi_write:1, w:1, sprite_no_limit:1;
+    enum Mirroring      mirroring;
+    uint16_t            scanline, ppu_cycles, v, t;
+    short               sprite_0_hit_dot;
+
+    uint8_t             palette_table[32], sprite_y[64], sprite_height;
+    ScanlineState       scanlines[FRAME_HEIGHT];
+
+    APU                 apu;
+    Mapper              mapper;
+} NesClone;
+
+NesClone *clone_take(CPU *cpu, const NesClone *base);
+void clone_restore(CPU *cpu, const NesClone *clone, const NesClone *base);
+
+NesClone *clone_retain(NesClone *clone);
+void clone_release(NesClone *clone);
+
+#endif
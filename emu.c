@@ -1,6 +1,11 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "emu.h"
+#include "mapper.h"
 
-uint8_t NES_PALETTE[192] = {
+const uint8_t NES_PALETTE[192] = {
     0x80,0x80,0x80, 0x00,0x3D,0xA6, 0x00,0x12,0xB0, 0x44,0x00,0x96, 0xA1,0x00,0x5E,
     0xC7,0x00,0x28, 0xBA,0x06,0x00, 0x8C,0x17,0x00, 0x5C,0x2F,0x00, 0x10,0x45,0x00,
     0x05,0x4A,0x00, 0x00,0x47,0x2E, 0x00,0x41,0x66, 0x00,0x00,0x00, 0x05,0x05,0x05,
@@ -16,7 +21,115 @@ uint8_t NES_PALETTE[192] = {
     0x99,0xFF,0xFC, 0xDD,0xDD,0xDD, 0x11,0x11,0x11, 0x11,0x11,0x11
 };
 
-uint8_t test_frame[TEST_FRAME_LENGTH];
+// NES_PALETTE resolved for each combination of the three emphasis bits
+const NesPalette NES_PALETTE_RGBA = {
+{
+    {
+        0xFF808080, 0xFFA63D00, 0xFFB01200, 0xFF960044, 0xFF5E00A1, 0xFF2800C7,
+        0xFF0006BA, 0xFF00178C, 0xFF002F5C, 0xFF004510, 0xFF004A05, 0xFF2E4700,
+        0xFF664100, 0xFF000000, 0xFF050505, 0xFF050505, 0xFFC7C7C7, 0xFFFF7700,
+        0xFFFF5521, 0xFFFA3782, 0xFFB52FEB, 0xFF5029FF, 0xFF0022FF, 0xFF0032D6,
+        0xFF0062C4, 0xFF008035, 0xFF008F05, 0xFF558A00, 0xFFCC9900, 0xFF212121,
+        0xFF090909, 0xFF090909, 0xFFFFFFFF, 0xFFFFD70F, 0xFFFFA269, 0xFFFF80D4,
+        0xFFF345FF, 0xFF8B61FF, 0xFF3388FF, 0xFF129CFF, 0xFF20BCFA, 0xFF0EE39F,
+        0xFF35F02B, 0xFFA4F00C, 0xFFFFFB05, 0xFF5E5E5E, 0xFF0D0D0D, 0xFF0D0D0D,
+        0xFFFFFFFF, 0xFFFFFCA6, 0xFFFFECB3, 0xFFEBABDA, 0xFFF9A8FF, 0xFFB3ABFF,
+        0xFFB0D2FF, 0xFFA6EFFF, 0xFF9CF7FF, 0xFF95E8D7, 0xFFAFEDA6, 0xFFDAF2A2,
+        0xFFFCFF99, 0xFFDDDDDD, 0xFF111111, 0xFF111111
+    },
+    {
+        0xFF606080, 0xFF7C2D00, 0xFF840D00, 0xFF700044, 0xFF4600A1, 0xFF1E00C7,
+        0xFF0004BA, 0xFF00118C, 0xFF00235C, 0xFF003310, 0xFF003705, 0xFF223500,
+        0xFF4C3000, 0xFF000000, 0xFF030305, 0xFF030305, 0xFF9595C7, 0xFFBF5900,
+        0xFFBF3F21, 0xFFBB2982, 0xFF8723EB, 0xFF3C1EFF, 0xFF0019FF, 0xFF0025D6,
+        0xFF0049C4, 0xFF006035, 0xFF006B05, 0xFF3F6700, 0xFF997200, 0xFF181821,
+        0xFF060609, 0xFF060609, 0xFFBFBFFF, 0xFFBFA10F, 0xFFBF7969, 0xFFBF60D4,
+        0xFFB633FF, 0xFF6848FF, 0xFF2666FF, 0xFF0D75FF, 0xFF188DFA, 0xFF0AAA9F,
+        0xFF27B42B, 0xFF7BB40C, 0xFFBFBC05, 0xFF46465E, 0xFF09090D, 0xFF09090D,
+        0xFFBFBFFF, 0xFFBFBDA6, 0xFFBFB1B3, 0xFFB080DA, 0xFFBA7EFF, 0xFF8680FF,
+        0xFF849DFF, 0xFF7CB3FF, 0xFF75B9FF, 0xFF6FAED7, 0xFF83B1A6, 0xFFA3B5A2,
+        0xFFBDBF99, 0xFFA5A5DD, 0xFF0C0C11, 0xFF0C0C11
+    },
+    {
+        0xFF608060, 0xFF7C3D00, 0xFF841200, 0xFF700033, 0xFF460078, 0xFF1E0095,
+        0xFF00068B, 0xFF001769, 0xFF002F45, 0xFF00450C, 0xFF004A03, 0xFF224700,
+        0xFF4C4100, 0xFF000000, 0xFF030503, 0xFF030503, 0xFF95C795, 0xFFBF7700,
+        0xFFBF5518, 0xFFBB3761, 0xFF872FB0, 0xFF3C29BF, 0xFF0022BF, 0xFF0032A0,
+        0xFF006293, 0xFF008027, 0xFF008F03, 0xFF3F8A00, 0xFF999900, 0xFF182118,
+        0xFF060906, 0xFF060906, 0xFFBFFFBF, 0xFFBFD70B, 0xFFBFA24E, 0xFFBF809F,
+        0xFFB645BF, 0xFF6861BF, 0xFF2688BF, 0xFF0D9CBF, 0xFF18BCBB, 0xFF0AE377,
+        0xFF27F020, 0xFF7BF009, 0xFFBFFB03, 0xFF465E46, 0xFF090D09, 0xFF090D09,
+        0xFFBFFFBF, 0xFFBFFC7C, 0xFFBFEC86, 0xFFB0ABA3, 0xFFBAA8BF, 0xFF86ABBF,
+        0xFF84D2BF, 0xFF7CEFBF, 0xFF75F7BF, 0xFF6FE8A1, 0xFF83ED7C, 0xFFA3F279,
+        0xFFBDFF72, 0xFFA5DDA5, 0xFF0C110C, 0xFF0C110C
+    },
+    {
+        0xFF486060, 0xFF5D2D00, 0xFF630D00, 0xFF540033, 0xFF340078, 0xFF160095,
+        0xFF00048B, 0xFF001169, 0xFF002345, 0xFF00330C, 0xFF003703, 0xFF193500,
+        0xFF393000, 0xFF000000, 0xFF020303, 0xFF020303, 0xFF6F9595, 0xFF8F5900,
+        0xFF8F3F18, 0xFF8C2961, 0xFF6523B0, 0xFF2D1EBF, 0xFF0019BF, 0xFF0025A0,
+        0xFF004993, 0xFF006027, 0xFF006B03, 0xFF2F6700, 0xFF727200, 0xFF121818,
+        0xFF040606, 0xFF040606, 0xFF8FBFBF, 0xFF8FA10B, 0xFF8F794E, 0xFF8F609F,
+        0xFF8833BF, 0xFF4E48BF, 0xFF1C66BF, 0xFF0975BF, 0xFF128DBB, 0xFF07AA77,
+        0xFF1DB420, 0xFF5CB409, 0xFF8FBC03, 0xFF344646, 0xFF060909, 0xFF060909,
+        0xFF8FBFBF, 0xFF8FBD7C, 0xFF8FB186, 0xFF8480A3, 0xFF8B7EBF, 0xFF6480BF,
+        0xFF639DBF, 0xFF5DB3BF, 0xFF57B9BF, 0xFF53AEA1, 0xFF62B17C, 0xFF7AB579,
+        0xFF8DBF72, 0xFF7BA5A5, 0xFF090C0C, 0xFF090C0C
+    },
+    {
+        0xFF806060, 0xFFA62D00, 0xFFB00D00, 0xFF960033, 0xFF5E0078, 0xFF280095,
+        0xFF00048B, 0xFF001169, 0xFF002345, 0xFF00330C, 0xFF003703, 0xFF2E3500,
+        0xFF663000, 0xFF000000, 0xFF050303, 0xFF050303, 0xFFC79595, 0xFFFF5900,
+        0xFFFF3F18, 0xFFFA2961, 0xFFB523B0, 0xFF501EBF, 0xFF0019BF, 0xFF0025A0,
+        0xFF004993, 0xFF006027, 0xFF006B03, 0xFF556700, 0xFFCC7200, 0xFF211818,
+        0xFF090606, 0xFF090606, 0xFFFFBFBF, 0xFFFFA10B, 0xFFFF794E, 0xFFFF609F,
+        0xFFF333BF, 0xFF8B48BF, 0xFF3366BF, 0xFF1275BF, 0xFF208DBB, 0xFF0EAA77,
+        0xFF35B420, 0xFFA4B409, 0xFFFFBC03, 0xFF5E4646, 0xFF0D0909, 0xFF0D0909,
+        0xFFFFBFBF, 0xFFFFBD7C, 0xFFFFB186, 0xFFEB80A3, 0xFFF97EBF, 0xFFB380BF,
+        0xFFB09DBF, 0xFFA6B3BF, 0xFF9CB9BF, 0xFF95AEA1, 0xFFAFB17C, 0xFFDAB579,
+        0xFFFCBF72, 0xFFDDA5A5, 0xFF110C0C, 0xFF110C0C
+    },
+    {
+        0xFF604860, 0xFF7C2100, 0xFF840900, 0xFF700033, 0xFF460078, 0xFF1E0095,
+        0xFF00038B, 0xFF000C69, 0xFF001A45, 0xFF00260C, 0xFF002903, 0xFF222700,
+        0xFF4C2400, 0xFF000000, 0xFF030203, 0xFF030203, 0xFF956F95, 0xFFBF4200,
+        0xFFBF2F18, 0xFFBB1E61, 0xFF871AB0, 0xFF3C16BF, 0xFF0012BF, 0xFF001BA0,
+        0xFF003693, 0xFF004827, 0xFF005003, 0xFF3F4D00, 0xFF995500, 0xFF181218,
+        0xFF060406, 0xFF060406, 0xFFBF8FBF, 0xFFBF780B, 0xFFBF5A4E, 0xFFBF489F,
+        0xFFB626BF, 0xFF6836BF, 0xFF264CBF, 0xFF0D57BF, 0xFF1869BB, 0xFF0A7F77,
+        0xFF278720, 0xFF7B8709, 0xFFBF8D03, 0xFF463446, 0xFF090609, 0xFF090609,
+        0xFFBF8FBF, 0xFFBF8D7C, 0xFFBF8486, 0xFFB060A3, 0xFFBA5EBF, 0xFF8660BF,
+        0xFF8475BF, 0xFF7C86BF, 0xFF758ABF, 0xFF6F82A1, 0xFF83847C, 0xFFA38779,
+        0xFFBD8F72, 0xFFA57BA5, 0xFF0C090C, 0xFF0C090C
+    },
+    {
+        0xFF606048, 0xFF7C2D00, 0xFF840D00, 0xFF700026, 0xFF46005A, 0xFF1E006F,
+        0xFF000468, 0xFF00114E, 0xFF002333, 0xFF003309, 0xFF003702, 0xFF223500,
+        0xFF4C3000, 0xFF000000, 0xFF030302, 0xFF030302, 0xFF95956F, 0xFFBF5900,
+        0xFFBF3F12, 0xFFBB2948, 0xFF872384, 0xFF3C1E8F, 0xFF00198F, 0xFF002578,
+        0xFF00496E, 0xFF00601D, 0xFF006B02, 0xFF3F6700, 0xFF997200, 0xFF181812,
+        0xFF060604, 0xFF060604, 0xFFBFBF8F, 0xFFBFA108, 0xFFBF793A, 0xFFBF6077,
+        0xFFB6338F, 0xFF68488F, 0xFF26668F, 0xFF0D758F, 0xFF188D8C, 0xFF0AAA59,
+        0xFF27B418, 0xFF7BB406, 0xFFBFBC02, 0xFF464634, 0xFF090906, 0xFF090906,
+        0xFFBFBF8F, 0xFFBFBD5D, 0xFFBFB164, 0xFFB0807A, 0xFFBA7E8F, 0xFF86808F,
+        0xFF849D8F, 0xFF7CB38F, 0xFF75B98F, 0xFF6FAE78, 0xFF83B15D, 0xFFA3B55A,
+        0xFFBDBF55, 0xFFA5A57B, 0xFF0C0C09, 0xFF0C0C09
+    },
+    {
+        0xFF484848, 0xFF5D2100, 0xFF630900, 0xFF540026, 0xFF34005A, 0xFF16006F,
+        0xFF000368, 0xFF000C4E, 0xFF001A33, 0xFF002609, 0xFF002902, 0xFF192700,
+        0xFF392400, 0xFF000000, 0xFF020202, 0xFF020202, 0xFF6F6F6F, 0xFF8F4200,
+        0xFF8F2F12, 0xFF8C1E48, 0xFF651A84, 0xFF2D168F, 0xFF00128F, 0xFF001B78,
+        0xFF00366E, 0xFF00481D, 0xFF005002, 0xFF2F4D00, 0xFF725500, 0xFF121212,
+        0xFF040404, 0xFF040404, 0xFF8F8F8F, 0xFF8F7808, 0xFF8F5A3A, 0xFF8F4877,
+        0xFF88268F, 0xFF4E368F, 0xFF1C4C8F, 0xFF09578F, 0xFF12698C, 0xFF077F59,
+        0xFF1D8718, 0xFF5C8706, 0xFF8F8D02, 0xFF343434, 0xFF060606, 0xFF060606,
+        0xFF8F8F8F, 0xFF8F8D5D, 0xFF8F8464, 0xFF84607A, 0xFF8B5E8F, 0xFF64608F,
+        0xFF63758F, 0xFF5D868F, 0xFF578A8F, 0xFF538278, 0xFF62845D, 0xFF7A875A,
+        0xFF8D8F55, 0xFF7B7B7B, 0xFF090909, 0xFF090909
+    }
+}
+};
 
 void apu_pulse_set_duty(Pulse *pulse, uint8_t data)
 {
@@ -219,6 +332,124 @@ void apu_triangle_set_counter_hi_timer(Triangle *triangle, uint8_t data)
     triangle->timer_period |= (unsigned short)triangle->timer_high << 8;
 }
 
+void palette_from_rgb(NesPalette *palette, const uint8_t rgb[192])
+{
+    for (int emphasis = 0; emphasis < 8; emphasis++)
+    {
+        for (int color = 0; color < 64; color++)
+        {
+            unsigned char channels[3] = { rgb[color * 3], rgb[color * 3 + 1], rgb[color * 3 + 2] };
+
+            // each emphasis bit darkens the other two channels
+            for (int channel = 0; channel < 3; channel++)
+                for (int bit = 0; bit < 3; bit++)
+                    if (bit != channel && emphasis & (1 << bit))
+                        channels[channel] = channels[channel] * 3 / 4;
+
+            palette->rgba[emphasis][color] = PALETTE_RGBA(channels[0], channels[1], channels[2]);
+        }
+    }
+}
+
+bool palette_load(NesPalette *palette, const char *filename)
+{
+    FILE            *f;
+    unsigned char   rgb[512 * 3];
+    size_t          len;
+
+    if (!(f = fopen(filename, "rb")))
+    {
+        fprintf(stderr, "Could not open palette file!\n");
+        return false;
+    }
+
+    len = fread(rgb, 1, sizeof(rgb), f);
+    fclose(f);
+
+    if (len == 64 * 3)
+    {
+        palette_from_rgb(palette, rgb);
+        return true;
+    }
+
+    if (len != 512 * 3)
+    {
+        fprintf(stderr, "Palette file must hold 64 or 512 RGB colors!\n");
+        return false;
+    }
+
+    // 512 entry files carry all emphasis sets, in emphasis order
+    for (int i = 0; i < 512; i++)
+        palette->rgba[i >> 6][i & 63] = PALETTE_RGBA(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+
+    return true;
+}
+
+static float palette_ntsc_signal(unsigned char color, unsigned char level, unsigned char emphasis, int phase)
+{
+    static const float  levels[8] = { 0.350f, 0.518f, 0.962f, 1.550f, 1.094f, 1.506f, 1.962f, 1.962f };
+
+    if (color > 13)
+        level = 1;
+
+    float           low = levels[level],
+                    high = levels[4 + level],
+                    signal;
+
+    if (color == 0)     low = high;
+    if (color > 12)     high = low;
+
+    signal = (color + phase) % 12 < 6 ? high : low;
+
+    // emphasis attenuates the signal during the red, green and blue phases
+    if (((emphasis & 1) && (0 + phase) % 12 < 6) 
+    || ((emphasis & 2) && (4 + phase) % 12 < 6) 
+    || ((emphasis & 4) && (8 + phase) % 12 < 6))
+        signal *= 0.746f;
+
+    return signal;
+}
+
+static unsigned char palette_clamp(float value)
+{
+    if (value <= 0.0f)  return 0;
+    if (value >= 1.0f)  return 255;
+
+    return (unsigned char)(value * 255.0f + 0.5f);
+}
+
+void palette_generate(NesPalette *palette, float saturation, float hue)
+{
+    for (int emphasis = 0; emphasis < 8; emphasis++)
+    {
+        for (int color = 0; color < 64; color++)
+        {
+            float y = 0.0f, i = 0.0f, q = 0.0f;
+
+            // decode one colour clock of the composite signal as YIQ
+            for (int phase = 0; phase < 12; phase++)
+            {
+                float   level = (palette_ntsc_signal(color & 0x0F, color >> 4, emphasis, phase) - 0.518f) 
+                                / (1.962f - 0.518f),
+                        angle = 3.14159265f * (phase + 3.9f) / 6.0f + hue;
+
+                y += level;
+                i += level * cosf(angle);
+                q += level * sinf(angle);
+            }
+
+            y /= 12.0f;
+            i *= saturation / 12.0f;
+            q *= saturation / 12.0f;
+
+            palette->rgba[emphasis][color] = PALETTE_RGBA(
+                palette_clamp(y + 0.946882f * i + 0.623557f * q),
+                palette_clamp(y - 0.274788f * i - 0.635691f * q),
+                palette_clamp(y - 1.108545f * i + 1.709007f * q));
+        }
+    }
+}
+
 void joypad_init(Joypad *joypad)
 {
     joypad->button_status = 0;
@@ -251,779 +482,746 @@ unsigned char joypad_read(Joypad *joypad)
 
 void frame_init(Frame *frame)
 {
-    for (int i = 0; i < FRAME_LENGTH; i++)
-        frame->data[i] = 0;
+    memset(frame->data, 0, sizeof(frame->data));
+}
 
-    memset(test_frame, 0, TEST_FRAME_LENGTH);
+void frameskip_init(FrameSkip *skip, unsigned char interval)
+{
+    skip->interval = interval;
+    skip->count = 0;
+    skip->requested = false;
 }
 
-void frame_set_pixel(uint8_t frame[], short x, short y, unsigned char rgb[3])
+void frameskip_request(FrameSkip *skip)
 {
-    int base = ((y * 3) << 8) + (x * 3);
+    skip->requested = true;
+}
 
-    if ((base + 2) < FRAME_LENGTH)
+bool frameskip_next(FrameSkip *skip)
+{
+    // only decides whether pixels get drawn, the PPU ticks the same either way
+    bool draw = skip->requested;
+
+    skip->requested = false;
+
+    if (skip->interval)
     {
-        frame[base] = rgb[0];
-        frame[base + 1] = rgb[1];
-        frame[base + 2] = rgb[2];
+        if (++skip->count >= skip->interval)
+            skip->count = 0;
+
+        draw |= skip->count == 0;
     }
+
+    return draw;
 }
 
-Palette bg_palette(PPU *ppu, unsigned char *attr_table, unsigned char tile_column, unsigned char tile_row)
+unsigned short ppu_coarse_x_add(unsigned short v, short n)
 {
-    Palette palette;
+    // coarse x plus the horizontal nametable bit form one 6-bit tile column
+    unsigned char column = (((v >> 10) & 1) << 5) | (v & 0x1F);
 
-    unsigned char   attr_table_idx = ((tile_row / 4) * 8) + (tile_column / 4),
-                    attr_byte = attr_table[attr_table_idx];
+    column = (column + n) & 0x3F;
 
-    unsigned char   palette_idx = 0;
+    return (v & ~0x041F) | ((column >> 5) << 10) | (column & 0x1F);
+}
 
-    /*
-        ________________
-       |       ||       |
-       |       ||       |
-       |       ||       |
-       |-------||-------|
-       |       ||       |
-       |       ||       |
-       |       ||       |
-        ----------------
-    */
+unsigned short ppu_increment_y(unsigned short v)
+{
+    if ((v & 0x7000) != 0x7000)
+        return v + 0x1000;
+
+    unsigned short coarse_y = (v & 0x03E0) >> 5;
 
-    if ((tile_column % 4 / 2) == 0)
+    v &= ~0x7000;
+
+    if (coarse_y == 29)
     {
-        if ((tile_row % 4 / 2) == 0)
-        {
-            palette_idx = attr_byte & 0b11;
-        }
-        else if ((tile_row % 4 / 2) == 1)
-        {
-            palette_idx = (attr_byte >> 4) & 0b11;
-        }
+        coarse_y = 0;
+        v ^= 0x0800;
     }
-    else if ((tile_column % 4 / 2) == 1)
+    else if (coarse_y == 31)
+        coarse_y = 0;
+    else
+        coarse_y += 1;
+
+    return (v & ~0x03E0) | (coarse_y << 5);
+}
+
+void ppu_render(PPU *ppu, Frame *frame)
+{
+    for (short line = 0; line < FRAME_HEIGHT; line++)
+        ppu_render_scanline(ppu, frame->data, line);
+}
+
+void ppu_log_write(PPU *ppu, enum PpuLogTarget target, unsigned short addr, unsigned char value)
+{
+    PpuWriteLog *log = ppu->log;
+
+    if (log->count == PPU_LOG_LENGTH)
     {
-        if ((tile_row % 4 / 2) == 0)
-        {
-            palette_idx = (attr_byte >> 2) & 0b11;
-        }
-        else if ((tile_row % 4 / 2) == 1)
-        {
-            palette_idx = (attr_byte >> 6) & 0b11;
-        }
+        log->overflow = true;
+        return;
     }
 
-    unsigned char palette_start = 1 + (palette_idx * 4);
+    PpuWrite *write = &log->writes[log->count++];
 
-    palette.p1 = ppu->palette_table[0];
-    palette.p2 = ppu->palette_table[palette_start];
-    palette.p3 = ppu->palette_table[palette_start + 1];
-    palette.p4 = ppu->palette_table[palette_start + 2];
+    write->target = target;
+    write->addr = addr;
+    write->value = value;
 
-    return palette;
+    // the line latched before this write is the first one it can show up on
+    write->line = ppu->scanline > FRAME_HEIGHT ? 0 : ppu->scanline + 1;
 }
 
-void ppu_render_name_table(
-    PPU *ppu, 
-    Frame *frame,
-    unsigned char test_frame[], 
-    unsigned char *name_table, 
-    Rect viewport,
-    short shift_x, 
-    short shift_y)
+void ppu_log_close(PPU *ppu)
 {
-    unsigned char   bank        = ppu->ctrl & BACKGROUND_PATTERN_ADDR,
-                    *attr_table = &name_table[0x3C0];
+    PpuWriteLog *log = ppu->log;
+
+    memcpy(log->scanlines, ppu->scanlines, sizeof(log->scanlines));
+
+    if (!log->overflow)
+        return;
+
+    memcpy(log->vram, ppu->vram, sizeof(log->vram));
+    memcpy(log->palette_table, ppu->palette_table, sizeof(log->palette_table));
+    memcpy(log->oam_data, ppu->oam_data, sizeof(log->oam_data));
+    log->mirroring = ppu->mirroring;
+    memcpy(log->chr_bank_numbers, ppu->chr_bank_numbers, sizeof(log->chr_bank_numbers));
+
+    if (ppu->chr_ram)
+        memcpy(log->chr_ram, ppu->chr_ram, sizeof(log->chr_ram));
+}
 
-    for (int i = 0; i < 0x3C0; i++)
+// chr ram behind a pattern table address, through whatever bank it shows
+static void ppu_write_chr(PPU *ppu, unsigned short addr, unsigned char data)
+{
+    unsigned short chr_idx = ppu->chr_bank_numbers[addr >> 10] << 10 | (addr & 0x3FF);
+
+    ppu->chr_ram[chr_idx] = data;
+    ppu->chr_dirty_pages |= (uint32_t)1 << (chr_idx >> 8);
+    ppu_invalidate_pattern(ppu, addr);
+}
+
+void ppu_apply_write(PPU *ppu, const PpuWrite *write)
+{
+    switch (write->target)
+    {
+        case PPU_LOG_VRAM:
+            ppu->vram[write->addr] = write->value;
+
+            if ((write->addr & 0x3FF) >= 0x3C0)
+                ppu_update_attribute(ppu, write->addr);
+
+            ppu_invalidate_name_table(ppu, write->addr);
+            break;
+        case PPU_LOG_PALETTE:
+            ppu->palette_table[write->addr] = write->value;
+            break;
+        case PPU_LOG_OAM:
+            ppu->oam_data[write->addr] = write->value;
+            break;
+        case PPU_LOG_CHR:
+            ppu_write_chr(ppu, write->addr, write->value);
+            break;
+        case PPU_LOG_MIRRORING:
+            ppu_set_mirroring(ppu, write->value);
+            break;
+        case PPU_LOG_CHR_BANK:
+            ppu_set_chr_bank(ppu, write->value, write->addr);
+            break;
+        default:
+            break;
+    }
+}
+
+void ppu_render_log(PPU *ppu, const PpuWriteLog *log, Frame *frame)
+{
+    unsigned int i = 0;
+
+    // writes were dropped, fall back to the memory as it was at the end
+    if (log->overflow)
     {
-        unsigned char   tile_idx = name_table[i], 
-                        tile_column = i % 32,
-                        tile_row = i >> 5,
-                        *tile = &ppu->chr_rom[(bank ? 0x1000 : 0) + (tile_idx << 4)];
+        memcpy(ppu->vram, log->vram, sizeof(ppu->vram));
+        memcpy(ppu->palette_table, log->palette_table, sizeof(ppu->palette_table));
+        memcpy(ppu->oam_data, log->oam_data, sizeof(ppu->oam_data));
+
+        if (ppu->chr_ram)
+            memcpy(ppu->chr_ram, log->chr_ram, sizeof(log->chr_ram));
+
+        memcpy(ppu->chr_bank_numbers, log->chr_bank_numbers, sizeof(ppu->chr_bank_numbers));
+        ppu_map_chr(ppu);
+        ppu_set_mirroring(ppu, log->mirroring);
+        ppu_update_attributes(ppu);
+
+        i = log->count;
+    }
+
+    memcpy(ppu->scanlines, log->scanlines, sizeof(ppu->scanlines));
+
+    for (; i < log->count && log->writes[i].line == 0; i++)
+        ppu_apply_write(ppu, &log->writes[i]);
+
+    if (log->render)
+    {
+        // same oam and sprite size the emulation thread evaluated at line 0
+        ppu->ctrl = log->scanlines[0].ctrl;
+        ppu_evaluate_sprites(ppu);
+    }
+
+    for (short line = 0; line < FRAME_HEIGHT; line++)
+    {
+        if (log->render)
+            ppu_render_scanline(ppu, frame->data, line);
+
+        for (; i < log->count && log->writes[i].line <= line + 1; i++)
+            ppu_apply_write(ppu, &log->writes[i]);
+    }
 
-        Palette         palette = bg_palette(ppu, attr_table, tile_column, tile_row);
+    for (; i < log->count; i++)
+        ppu_apply_write(ppu, &log->writes[i]);
+}
+
+void ppu_evaluate_sprites(PPU *ppu)
+{
+    ppu->sprite_height = ppu->ctrl & SPRITE_SIZE ? 16 : 8;
+
+    for (int i = 0; i < 64; i++)
+        ppu->sprite_y[i] = ppu->oam_data[i << 2];
+
+    ppu_evaluate_sprite_lines(ppu);
+}
+
+void ppu_evaluate_sprite_lines(PPU *ppu)
+{
+    unsigned char   height = ppu->sprite_height,
+                    limit = ppu->sprite_no_limit ? 64 : 8;
+
+    ppu->overflow_line = -1;
 
-        for (int y = 0; y <= 7; y++)
+    for (int line = 0; line < FRAME_HEIGHT; line++)
+        ppu->secondary_oam[line].count = 0;
+
+    for (int i = 0; i < 64; i++)
+    {
+        // sprites are drawn one line below their OAM y position
+        short top = ppu->sprite_y[i] + 1;
+
+        for (short line = top; line < top + height && line < FRAME_HEIGHT; line++)
         {
-            unsigned char   upper = tile[y], 
-                            lower = tile[y + 8];
+            SecondaryOAM *secondary = &ppu->secondary_oam[line];
 
-            for (int x = 7; x >= 0; x--)
-            {
-                unsigned char value = (1 & lower) << 1 | (1 & upper);
+            if (secondary->count >= 8 
+            && (ppu->overflow_line < 0 || line < ppu->overflow_line))
+                ppu->overflow_line = line;
 
-                upper >>= 1;
-                lower >>= 1;
+            if (secondary->count < limit)
+                secondary->sprites[secondary->count++] = i;
+        }
+    }
+}
 
-                unsigned char *rgb;
+const unsigned char *ppu_sprite_tile_row(PPU *ppu, unsigned char *sprite, short row, unsigned char ctrl)
+{
+    unsigned short  bank = ctrl & SPRITE_PATTERN_ADDR ? 0x1000 : 0;
+    unsigned char   tile_idx = sprite[1];
 
-                switch (value)
-                {
-                    case 0:
-                        rgb = &NES_PALETTE[palette.p1 * 3];
-                        break;
-                    case 1:
-                        rgb = &NES_PALETTE[palette.p2 * 3];
-                        break;
-                    case 2:
-                        rgb = &NES_PALETTE[palette.p3 * 3];
-                        break;
-                    case 3:
-                        rgb = &NES_PALETTE[palette.p4 * 3];
-                        break;
-                    default: 
-                        // should not be
-                        break;
-                }
+    if (sprite[2] & 0b10000000)
+        row = ppu->sprite_height - 1 - row;
 
-                unsigned char   pixel_x = (tile_column << 3) + x,
-                                pixel_y = (tile_row << 3) + y;
+    if (ppu->sprite_height == 16)
+    {
+        // 8x16 sprites pick their bank from bit 0 of the tile index
+        bank = tile_idx & 1 ? 0x1000 : 0;
+        tile_idx &= 0b11111110;
 
-                if (pixel_x >= viewport.x1 && pixel_x < viewport.x2 
-                && pixel_y >= viewport.y1 && pixel_y < viewport.y2)
-                {
-                    // for testing
-                    //unsigned char   xpos = shift_x + pixel_x >> 5,
-                    //                ypos = xpos * shift_y + pixel_y;
-
-                    // 1 << (xpos >> 3)
-
-                    int base = (shift_y + pixel_y) * FRAME_WIDTH + (shift_x + pixel_x);
-                    if (value != 0)
-                    {
-                        if (base < TEST_FRAME_LENGTH)
-                            test_frame[base] = 1;
-                    }
-                    //
-                    frame_set_pixel(
-                        frame->data, 
-                        (short)(shift_x + pixel_x), 
-                        (short)(shift_y + pixel_y), 
-                        rgb);
-                }
-            }
+        if (row > 7)
+        {
+            tile_idx++;
+            row -= 8;
         }
     }
+
+    unsigned short addr = bank + (tile_idx << 4) + row;
+
+    return &ppu->chr_banks[addr >> 10][addr & 0x3FF];
 }
 
-Palette ppu_sprite_palette(PPU *ppu, unsigned char palette_idx)
+static unsigned char ppu_reverse_bits(unsigned char b)
 {
-    Palette palette;
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
 
-    unsigned char start = 0x11 + (palette_idx * 4);
+    return b;
+}
 
-    palette.p1 = 0;
-    palette.p2 = ppu->palette_table[start];
-    palette.p3 = ppu->palette_table[start + 1];
-    palette.p4 = ppu->palette_table[start + 2];
+unsigned char ppu_mask_get8(const uint64_t mask[4], short x)
+{
+    unsigned char   word = x >> 6,
+                    shift = x & 63;
+
+    uint64_t        bits = mask[word] >> shift;
 
-    return palette;
+    if (shift > 56 && word < 3)
+        bits |= mask[word + 1] << (64 - shift);
+
+    return bits & 0xFF;
 }
 
-void ppu_render(PPU *ppu, Frame *frame)
+void ppu_mask_set8(uint64_t mask[4], short x, unsigned char bits)
 {
-    unsigned char   scroll_x = ppu->scroll.x,
-                    scroll_y = ppu->scroll.y;
+    unsigned char   word = x >> 6,
+                    shift = x & 63;
 
-    unsigned char   *main_nametable, 
-                    *second_nametable,
-                    name_table = ppu->ctrl & 0b11;
+    mask[word] |= (uint64_t)bits << shift;
 
-    Rect rect;
+    if (shift > 56 && word < 3)
+        mask[word + 1] |= (uint64_t)bits >> (64 - shift);
+}
 
-    switch (ppu->mirroring)
-    {
-        case VERTICAL:
-            if (name_table == 0 || name_table == 2)
-            {
-                main_nametable = &ppu->vram[0];
-                second_nametable = &ppu->vram[0x400];
-            }
-            else if (name_table == 1 || name_table == 3)
-            {
-                main_nametable = &ppu->vram[0x400];
-                second_nametable = &ppu->vram[0];
-            }
-            break;
-        case HORIZONTAL:
-            if (name_table == 0 || name_table == 1)
-            {
-                main_nametable = &ppu->vram[0];
-                second_nametable = &ppu->vram[0x400];
-            }
-            else if (name_table == 2 || name_table == 3)
-            {
-                main_nametable = &ppu->vram[0x400];
-                second_nametable = &ppu->vram[0];
-            }
-        case FOUR_SCREEN:
-        default:
-            main_nametable = &ppu->vram[0];
-            second_nametable = &ppu->vram[0x400];
-            break;
-    }
+bool ppu_sprite_row(PPU *ppu, unsigned char *sprite, short line, ScanlineState *state, 
+                    unsigned char *upper, unsigned char *lower)
+{
+    // sprites are drawn one line below their OAM y position
+    short row = line - sprite[0] - 1;
 
-    rect.x1 = scroll_x;
-    rect.y1 = scroll_y;
-    rect.x2 = 256;
-    rect.y2 = 240;
+    if (row < 0 || row >= ppu->sprite_height)
+        return false;
 
-    ppu_render_name_table(
-        ppu, 
-        frame, 
-        test_frame,
-        main_nametable, 
-        rect, 
-        (short)-scroll_x, (short)-scroll_y);
+    const unsigned char *tile = ppu_sprite_tile_row(ppu, sprite, row, state->ctrl);
 
-    if (scroll_x > 0)
+    // bit n of the planes is the nth pixel right of the sprite's x position
+    if (sprite[2] & 0b01000000)
     {
-        rect.x1 = 0;
-        rect.y1 = 0;
-        rect.x2 = scroll_x;
-        rect.y2 = 240;
-        
-        ppu_render_name_table(
-            ppu, 
-            frame, 
-            test_frame,
-            second_nametable, 
-            rect, 
-            (short)256 - scroll_x, 0);
+        *upper = tile[0];
+        *lower = tile[8];
     }
-    else if (scroll_y > 0)
+    else
     {
-        rect.x1 = 0;
-        rect.y1 = 0;
-        rect.x2 = 256;
-        rect.y2 = scroll_y;
-        
-        ppu_render_name_table(
-            ppu, 
-            frame, 
-            test_frame,
-            second_nametable, 
-            rect, 
-            0, (short)240 - scroll_y);
+        *upper = ppu_reverse_bits(tile[0]);
+        *lower = ppu_reverse_bits(tile[8]);
     }
 
-    // draw sprites
-    for (int i = 252; i >= 0; i -= 4)
+    unsigned char   x = sprite[3],
+                    visible = 0xFF;
+
+    if (x < 8 && !(state->mask & SPRITES_LEFTMOST))
+        visible <<= 8 - x;
+
+    if (x > FRAME_WIDTH - 8)
+        visible &= 0xFF >> (x - (FRAME_WIDTH - 8));
+
+    *upper &= visible;
+    *lower &= visible;
+
+    return true;
+}
+
+void ppu_render_scanline_sprite(PPU *ppu, uint32_t pixels[], const uint32_t colors[32], uint64_t opaque[4], short line)
+{
+    ScanlineState   *state = &ppu->scanlines[line];
+    SecondaryOAM    *secondary = &ppu->secondary_oam[line];
+
+    // set once a lower-index sprite owns the pixel, even one behind the background
+    uint64_t        taken[4] = { 0 };
+
+    if (!(state->mask & SPRITES_SHOW))
+        return;
+
+    for (int n = 0; n < secondary->count; n++)
     {
-        unsigned char   tile_y              = ppu->oam_data[i],
-                        tile_idx            = ppu->oam_data[i + 1],
-                        tile_x              = ppu->oam_data[i + 3];
+        unsigned char   *sprite = &ppu->oam_data[secondary->sprites[n] << 2],
+                        upper, 
+                        lower;
 
-        bool            flip_vertical       = ppu->oam_data[i + 2] & 0b10000000 ? true : false,
-                        flip_horizontal     = ppu->oam_data[i + 2] & 0b01000000 ? true : false;
+        if (!ppu_sprite_row(ppu, sprite, line, state, &upper, &lower))
+            continue;
 
-        unsigned char   palette_idx         = ppu->oam_data[i + 2] & 0b11;
+        unsigned char   tile_x = sprite[3],
+                        pixels_left = (upper | lower) & ~ppu_mask_get8(taken, tile_x);
 
-        Palette         sprite_palette      = ppu_sprite_palette(ppu, palette_idx);
+        const uint32_t  *sprite_colors = &colors[0x10 + ((sprite[2] & 0b11) << 2)];
 
-        unsigned char   bank                = ppu->ctrl & SPRITE_PATTERN_ADDR,
-                        *tile               = &ppu->chr_rom[(bank ? 0x1000 : 0) + (tile_idx << 4)];
+        ppu_mask_set8(taken, tile_x, pixels_left);
 
-        for (int y = 0; y <= 7; y++)
+        if (sprite[2] & 0b00100000)
+            pixels_left &= ~ppu_mask_get8(opaque, tile_x);
+
+        for (int x = 0; pixels_left; x++, pixels_left >>= 1)
         {
-            unsigned char   upper = tile[y],
-                            lower = tile[y + 8];
+            if (pixels_left & 1)
+                pixels[tile_x + x] = sprite_colors[((lower >> x) & 1) << 1 | ((upper >> x) & 1)];
+        }
+    }
+}
 
-            for (int x = 7; x >= 0; x--)
-            {
-                unsigned char value = (1 & lower) << 1 | (1 & upper);
+void ppu_background_mask(PPU *ppu, short line, uint64_t opaque[4])
+{
+    ScanlineState   *state = &ppu->scanlines[line];
 
-                upper >>= 1;
-                lower >>= 1;
+    // the first two tiles of a line are fetched at the end of the previous one
+    unsigned short  v = ppu_coarse_x_add(state->v, -2);
 
-                unsigned char *rgb;
+    unsigned char   bank = state->ctrl & BACKGROUND_PATTERN_ADDR,
+                    fine_y = (v >> 12) & 0b111;
 
-                switch (value)
-                {
-                    default:
-                        // should not happen
-                    case 0:
-                        continue;
-                    case 1:
-                        rgb = &NES_PALETTE[sprite_palette.p2 * 3];
-                        break;
-                    case 2:
-                        rgb = &NES_PALETTE[sprite_palette.p3 * 3];
-                        break;
-                    case 3:
-                        rgb = &NES_PALETTE[sprite_palette.p4 * 3];
-                        break;
-                }
+    short           pixel_x = -(short)state->x;
 
-                int base;
+    opaque[0] = opaque[1] = opaque[2] = opaque[3] = 0;
 
-                switch (flip_horizontal)
-                {
-                    case false:
-                        if (flip_vertical == false)
-                        {
-                            if (ppu->oam_data[i + 2] & 0b00100000)
-                            {
-                                base = ((tile_y + y) << 8) + (tile_x + x);
-
-                                if (base < TEST_FRAME_LENGTH && test_frame[base] == 1)
-                                    continue;
-                            }
-                            frame_set_pixel(
-                                frame->data, 
-                                (short)tile_x + x, 
-                                (short)tile_y + y, 
-                                rgb);
-                        }
-                        else
-                        {
-                            if (ppu->oam_data[i + 2] & 0b00100000)
-                            {
-                                base = ((tile_y + 7 - y) << 8) + (tile_x + x);
-
-                                if (base < TEST_FRAME_LENGTH && test_frame[base] == 1)
-                                    continue;
-                            }
-                            frame_set_pixel(
-                                frame->data, 
-                                (short)tile_x + x, 
-                                (short)tile_y + 7 - y, 
-                                rgb);
-                        }
-                        break;
-                    case true:
-                        if (flip_vertical == false)
-                        {
-                            if (ppu->oam_data[i + 2] & 0b00100000)
-                            {
-                                base = ((tile_y + y) << 8) + (tile_x + 7 - x);
-
-                                if (base < TEST_FRAME_LENGTH && test_frame[base] == 1)
-                                    continue;
-                            }
-                            frame_set_pixel(
-                                frame->data, 
-                                (short)tile_x + 7 - x, 
-                                (short)tile_y + y, 
-                                rgb);
-                        }
-                        else
-                        {
-                            if (ppu->oam_data[i + 2] & 0b00100000)
-                            {
-                                base = ((tile_y + 7 - y) << 8) + (tile_x + 7 - x);
-
-                                if (base < TEST_FRAME_LENGTH && test_frame[base] == 1)
-                                    continue;
-                            }
-                            frame_set_pixel(
-                                frame->data, 
-                                (short)tile_x + 7 - x, 
-                                (short)tile_y + 7 - y, 
-                                rgb);
-                        }
-                        break;
-                }
-            }
-        }
+    if (!(state->mask & BACKGROUND_SHOW))
+        return;
+
+    for (int i = 0; i < 33; i++, pixel_x += 8)
+    {
+        unsigned char       *name_table = ppu->name_tables[(v >> 10) & 0b11];
+        unsigned short      addr = (bank ? 0x1000 : 0) + (name_table[v & 0x3FF] << 4);
+        const unsigned char *tile = &ppu->chr_banks[addr >> 10][addr & 0x3FF];
+        unsigned char       bits = ppu_reverse_bits(tile[fine_y] | tile[fine_y + 8]);
+
+        v = ppu_coarse_x_add(v, 1);
+
+        // the first tile is partly scrolled off the left edge
+        if (pixel_x < 0)
+            ppu_mask_set8(opaque, 0, bits >> state->x);
+        else if (pixel_x < FRAME_WIDTH)
+            ppu_mask_set8(opaque, pixel_x, bits);
     }
 
-    memset(test_frame, 0, TEST_FRAME_LENGTH);
+    if (!(state->mask & BACKGROUND_LEFTMOST))
+        opaque[0] &= ~(uint64_t)0xFF;
 }
 
-void ppu_render_scanline_sprite(PPU *ppu, uint8_t frame[], uint8_t test[])
+void ppu_invalidate_background(PPU *ppu)
 {
-    for (int i = 252; i >= 0; i -= 4)
-    {
-        unsigned char   tile_y              = ppu->oam_data[i],
-                        tile_idx            = ppu->oam_data[i + 1],
-                        tile_x              = ppu->oam_data[i + 3];
+    for (int n = 0; n < 4; n++)
+        for (int row = 0; row < 32; row++)
+            ppu->bg_dirty[n][row] = 0xFFFFFFFF;
 
-        bool            flip_vertical       = ppu->oam_data[i + 2] & 0b10000000 ? true : false,
-                        flip_horizontal     = ppu->oam_data[i + 2] & 0b01000000 ? true : false;
+    ppu->bg_dirty_any = true;
+}
 
-        unsigned char   palette_idx         = ppu->oam_data[i + 2] & 0b11;
+void ppu_invalidate_name_table(PPU *ppu, unsigned short vram_idx)
+{
+    unsigned short  offset = vram_idx & 0x3FF;
 
-        Palette         sprite_palette      = ppu_sprite_palette(ppu, palette_idx);
+    for (int n = 0; n < 4; n++)
+    {
+        // a physical nametable shows up in every logical one mirrored onto it
+        if (ppu->name_tables[n] != &ppu->vram[vram_idx & ~0x3FF])
+            continue;
 
-        unsigned char   bank                = ppu->ctrl & SPRITE_PATTERN_ADDR,
-                        *tile               = &ppu->chr_rom[(bank ? 0x1000 : 0) + tile_idx * 16];
+        ppu->bg_dirty[n][offset >> 5] |= (uint32_t)1 << (offset & 0x1F);
 
-        for (int y = 0; y < 8; y++)
+        if (offset >= 0x3C0)
         {
-            if ((tile_y * 8 + y) == ppu->scanline - 1)
-            {
-                unsigned char   upper = tile[y],
-                                lower = tile[y + 8];
+            // an attribute byte colours a 4x4 tile block
+            unsigned char   block = offset - 0x3C0,
+                            column = (block & 0b111) << 2;
 
-                for (int x = 7; x >= 0; x--)
-                {
-                    unsigned char value = (1 & lower) << 1 | (1 & upper);
-
-                    upper >>= 1;
-                    lower >>= 1;
-
-                    unsigned char *rgb;
-
-                    switch (value)
-                    {
-                        default:
-                            // should not happen
-                        case 0:
-                            continue;
-                        case 1:
-                            rgb = &NES_PALETTE[sprite_palette.p2 * 3];
-                            break;
-                        case 2:
-                            rgb = &NES_PALETTE[sprite_palette.p3 * 3];
-                            break;
-                        case 3:
-                            rgb = &NES_PALETTE[sprite_palette.p4 * 3];
-                            break;
-                    }
-
-                    int base;
-
-                    switch (flip_horizontal)
-                    {
-                        case false:
-                            if (flip_vertical == false)
-                            {
-                                if (ppu->oam_data[i + 2] & 0b00100000)
-                                {
-                                    base = tile_x + x;
-
-                                    if (base < 256 && test[base] == 1)
-                                        continue;
-                                }
-                                frame_set_pixel(
-                                    frame, 
-                                    (short)tile_x + x, 
-                                    (short)tile_y + y, 
-                                    rgb);
-                            }
-                            else
-                            {
-                                if (ppu->oam_data[i + 2] & 0b00100000)
-                                {
-                                    base = tile_x + x;
-
-                                    if (base < 256 && test[base] == 1)
-                                        continue;
-                                }
-                                frame_set_pixel(
-                                    frame, 
-                                    (short)tile_x + x, 
-                                    (short)tile_y + 7 - y, 
-                                    rgb);
-                            }
-                            break;
-                        case true:
-                            if (flip_vertical == false)
-                            {
-                                if (ppu->oam_data[i + 2] & 0b00100000)
-                                {
-                                    base = tile_x + 7 - x;
-
-                                    if (base < 256 && test[base] == 1)
-                                        continue;
-                                }
-                                frame_set_pixel(
-                                    frame, 
-                                    (short)tile_x + 7 - x, 
-                                    (short)tile_y + y, 
-                                    rgb);
-                            }
-                            else
-                            {
-                                if (ppu->oam_data[i + 2] & 0b00100000)
-                                {
-                                    base = tile_x + 7 - x;
-
-                                    if (base < 256 && test[base] == 1)
-                                        continue;
-                                }
-                                frame_set_pixel(
-                                    frame, 
-                                    (short)tile_x + 7 - x, 
-                                    (short)tile_y + 7 - y, 
-                                    rgb);
-                            }
-                            break;
-                    }
-                }
-            }
+            for (int row = (block >> 3) << 2; row < ((block >> 3) << 2) + 4; row++)
+                ppu->bg_dirty[n][row] |= (uint32_t)0xF << column;
         }
     }
+
+    ppu->bg_dirty_any = true;
 }
 
-void ppu_render_scanline_nametable(
-    PPU *ppu,
-    unsigned char vfb[], 
-    unsigned char *name_table, 
-    Rect viewport,
-    short shift_x, 
-    short shift_y)
+void ppu_update_attributes(PPU *ppu)
 {
-    unsigned char   bank        = ppu->ctrl & BACKGROUND_PATTERN_ADDR,
-                    *attr_table = &name_table[0x3C0];
+    for (unsigned short n = 0; n < sizeof(ppu->vram); n += 0x400)
+    {
+        for (unsigned short idx = n + 0x3C0; idx < n + 0x400; idx++)
+            ppu_update_attribute(ppu, idx);
+    }
+}
 
-    //unsigned char test_vfb[256];
-    //memset(test_vfb, 0, 256);
+void ppu_update_attribute(PPU *ppu, unsigned short vram_idx)
+{
+    unsigned char   *palettes = ppu->tile_palettes[vram_idx >> 10],
+                    attr_byte = ppu->vram[vram_idx],
+                    block = (vram_idx & 0x3FF) - 0x3C0,
+                    top = (block >> 3) << 2,
+                    left = (block & 0b111) << 2;
 
-    for (int i = 0; i < 0x3C0; i++)
+    // each 2x2 tile quadrant of the block takes two bits of the attribute byte
+    for (int row = top; row < top + 4; row++)
+        for (int column = left; column < left + 4; column++)
+            palettes[(row << 5) + column] = (attr_byte >> (((row & 2) << 1) | (column & 2))) & 0b11;
+}
+
+void ppu_invalidate_pattern(PPU *ppu, unsigned short addr)
+{
+    unsigned char tile_idx = (addr >> 4) & 0xFF;
+
+    if ((addr & 0x1000) != ppu->bg_layer_bank)
+        return;
+
+    ppu->bg_pattern_dirty[tile_idx >> 6] |= (uint64_t)1 << (tile_idx & 63);
+    ppu->bg_dirty_any = true;
+}
+
+static void ppu_render_background_tile(PPU *ppu, unsigned char n, unsigned char column, unsigned char row)
+{
+    unsigned short  tile_offset = (row << 5) + column;
+
+    unsigned char       *name_table = ppu->name_tables[n],
+                        palette_start = ppu->tile_palettes[(name_table - ppu->vram) >> 10][tile_offset] << 2;
+    unsigned short      addr = ppu->bg_layer_bank + (name_table[tile_offset] << 4);
+    const unsigned char *tile = &ppu->chr_banks[addr >> 10][addr & 0x3FF];
+
+    for (int y = 0; y < 8; y++)
     {
-        unsigned char   tile_idx = name_table[i], 
-                        tile_column = i % 32,
-                        tile_row = i >> 5,
-                        *tile = &ppu->chr_rom[(bank ? 0x1000 : 0) + (tile_idx << 4)];
+        unsigned char   upper = tile[y],
+                        lower = tile[y + 8],
+                        *pixel = &ppu->bg_layer[((n >> 1) << 8) + (row << 3) + y][((n & 1) << 8) + (column << 3)];
 
-        Palette         palette = bg_palette(ppu, attr_table, tile_column, tile_row);
+        for (int bit = 7; bit >= 0; bit--, pixel++)
+        {
+            unsigned char value = ((lower >> bit) & 1) << 1 | ((upper >> bit) & 1);
 
+            *pixel = value ? palette_start | value : 0;
+        }
+    }
+}
 
-        for (int y = 0; y < 8; y++)
+void ppu_refresh_background(PPU *ppu, unsigned short bank)
+{
+    if (bank != ppu->bg_layer_bank)
+    {
+        ppu->bg_layer_bank = bank;
+        ppu_invalidate_background(ppu);
+    }
+
+    if (!ppu->bg_dirty_any)
+        return;
+
+    if (ppu->bg_pattern_dirty[0] | ppu->bg_pattern_dirty[1] 
+    | ppu->bg_pattern_dirty[2] | ppu->bg_pattern_dirty[3])
+    {
+        for (int n = 0; n < 4; n++)
         {
-            if ((tile_row * 8 + y) == ppu->scanline - 1)
+            unsigned char *name_table = ppu->name_tables[n];
+
+            for (int i = 0; i < 0x400; i++)
             {
-                unsigned char   upper = tile[y],
-                                lower = tile[y + 8];
+                unsigned char tile_idx = name_table[i];
 
-                for (int x = 7; x >= 0; x--)
-                {
-                    unsigned char value = (1 & lower) << 1 | (1 & upper);
-
-                    upper >>= 1;
-                    lower >>= 1;
-
-                    unsigned char *rgb;
-
-                    switch (value)
-                    {
-                        case 0:
-                            rgb = &NES_PALETTE[palette.p1 * 3];
-                            break;
-                        case 1:
-                            rgb = &NES_PALETTE[palette.p2 * 3];
-                            break;
-                        case 2:
-                            rgb = &NES_PALETTE[palette.p3 * 3];
-                            break;
-                        case 3:
-                            rgb = &NES_PALETTE[palette.p4 * 3];
-                            break;
-                        default: 
-                            // should not be
-                            break;
-                    }
-
-                    unsigned char   pixel_x = (tile_column << 3) + x,
-                                    pixel_y = (tile_row << 3) + y;
-
-                    if (pixel_x >= viewport.x1 && pixel_x < viewport.x2 
-                    && pixel_y >= viewport.y1 && pixel_y < viewport.y2)
-                    {
-                        // for testing
-                        /*
-                        int base = (shift_y + pixel_y) * FRAME_WIDTH + (shift_x + pixel_x);
-                        if (value != 0)
-                        {
-                            //if (base < TEST_FRAME_LENGTH)
-                                //test_frame[base] = 1;
-                        }
-                        //
-                        */
-
-                        frame_set_pixel(vfb, (short)shift_x + pixel_x, (short)shift_y + pixel_y, rgb);
-                        /*
-                        if (value != 0)
-                        {
-                            if (shift_x + pixel_x < 256)
-                                test_vfb[shift_x + pixel_x] = 1;
-                        }
-                        */
-                    }
-                }
+                if (ppu->bg_pattern_dirty[tile_idx >> 6] & ((uint64_t)1 << (tile_idx & 63)))
+                    ppu->bg_dirty[n][i >> 5] |= (uint32_t)1 << (i & 0x1F);
             }
         }
+
+        memset(ppu->bg_pattern_dirty, 0, sizeof(ppu->bg_pattern_dirty));
+    }
+
+    for (int n = 0; n < 4; n++)
+    {
+        for (int row = 0; row < 32; row++)
+        {
+            uint32_t dirty = ppu->bg_dirty[n][row];
+
+            for (; dirty; dirty &= dirty - 1)
+                ppu_render_background_tile(ppu, n, __builtin_ctz(dirty), row);
+
+            ppu->bg_dirty[n][row] = 0;
+        }
     }
 
-    //ppu_render_scanline_sprite(ppu, vfb, test_vfb);
+    ppu->bg_dirty_any = false;
 }
 
-void ppu_render_scanline(PPU *ppu, uint8_t frame[])
+void ppu_render_scanline_nametable(PPU *ppu, uint32_t pixels[], const uint32_t colors[32], uint64_t opaque[4], short line)
 {
-    //unsigned char   vfb_scanline[FRAME_PITCH];
-    //memset(vfb_scanline, 0, FRAME_PITCH);
+    ScanlineState   *state = &ppu->scanlines[line];
 
-    unsigned char   scroll_x = ppu->scroll.x,
-                    scroll_y = ppu->scroll.y;
+    // the first two tiles of a line are fetched at the end of the previous one
+    unsigned short  v = ppu_coarse_x_add(state->v, -2),
+                    layer_x = ((v & 0x0400) >> 2) | ((v & 0x1F) << 3) | state->x,
+                    layer_y = ((v & 0x0800) >> 3) | ((v & 0x03E0) >> 2) | ((v >> 12) & 0b111);
 
-    unsigned char   *main_nametable, 
-                    *second_nametable,
-                    name_table = ppu->ctrl & 0b11;
+    unsigned char   *row = ppu->bg_layer[layer_y];
 
-    Rect rect;
+    opaque[0] = opaque[1] = opaque[2] = opaque[3] = 0;
 
-    switch (ppu->mirroring)
+    if (!(state->mask & BACKGROUND_SHOW))
     {
-        case VERTICAL:
-            if (name_table == 0 || name_table == 2)
-            {
-                main_nametable = &ppu->vram[0];
-                second_nametable = &ppu->vram[0x400];
-            }
-            else if (name_table == 1 || name_table == 3)
-            {
-                main_nametable = &ppu->vram[0x400];
-                second_nametable = &ppu->vram[0];
-            }
-            break;
-        case HORIZONTAL:
-            if (name_table == 0 || name_table == 1)
-            {
-                main_nametable = &ppu->vram[0];
-                second_nametable = &ppu->vram[0x400];
-            }
-            else if (name_table == 2 || name_table == 3)
-            {
-                main_nametable = &ppu->vram[0x400];
-                second_nametable = &ppu->vram[0];
-            }
-        case FOUR_SCREEN:
-        default:
-            main_nametable = &ppu->vram[0];
-            second_nametable = &ppu->vram[0x400];
-            break;
+        for (short x = 0; x < FRAME_WIDTH; x++)
+            pixels[x] = colors[0];
+
+        return;
     }
 
-    rect.x1 = scroll_x;
-    rect.y1 = scroll_y;
-    rect.x2 = 256;
-    rect.y2 = 240;
+    ppu_refresh_background(ppu, state->ctrl & BACKGROUND_PATTERN_ADDR ? 0x1000 : 0);
+
+    for (short x = 0; x < FRAME_WIDTH; x++)
+    {
+        unsigned char value = row[(layer_x + x) & (BG_LAYER_WIDTH - 1)];
+
+        if (x < 8 && !(state->mask & BACKGROUND_LEFTMOST))
+            value = 0;
 
-    ppu_render_scanline_nametable(
-        ppu, frame, main_nametable, rect, (short)-scroll_x, (short)-scroll_y
-    );
+        if (value & 0b11)
+            opaque[x >> 6] |= (uint64_t)1 << (x & 63);
+        else
+            value = 0;
 
-    if (scroll_x > 0)
-    {
-        rect.x1 = 0;
-        rect.y1 = 0;
-        rect.x2 = scroll_x;
-        rect.y2 = 240;
-        
-        ppu_render_scanline_nametable(
-            ppu, frame, second_nametable, rect, (short)256 - scroll_x, 0
-        );
-    }
-    else if (scroll_y > 0)
-    {
-        rect.x1 = 0;
-        rect.y1 = 0;
-        rect.x2 = 256;
-        rect.y2 = scroll_y;
-        
-        ppu_render_scanline_nametable(
-            ppu, frame, second_nametable, rect, 0, (short)240 - scroll_y
-        );
+        pixels[x] = colors[value];
     }
 }
 
+void ppu_render_scanline(PPU *ppu, uint32_t frame[], short line)
+{
+    ScanlineState   *state = &ppu->scanlines[line];
+
+    // colours for this line's emphasis and greyscale bits, one lookup per entry
+    const uint32_t  *rgba = ppu->palette->rgba[state->mask >> 5];
+    unsigned char   grey = state->mask & GREYSCALE ? 0x30 : 0x3F;
+
+    uint32_t        colors[32],
+                    *pixels = &frame[line << 8];
+
+    uint64_t        opaque[4];
+
+    for (int i = 0; i < 32; i++)
+        colors[i] = rgba[ppu->palette_table[i] & grey];
+
+    ppu_render_scanline_nametable(ppu, pixels, colors, opaque, line);
+    ppu_render_scanline_sprite(ppu, pixels, colors, opaque, line);
+}
+
 unsigned char vram_addr_increment(enum PPUControlRegister ctrl)
 {
     if (ctrl & VRAM_ADD_INCREMENT)  return 32;
     else                            return 1;
 }
 
-void addr_reset(AddrRegister *addr)
+short ppu_sprite_0_hit_x(PPU *ppu, short line)
 {
-    addr->value[0] = 0;
-    addr->value[1] = 0;
-    addr->hi_ptr = true;
-}
+    ScanlineState   *state = &ppu->scanlines[line];
+    SecondaryOAM    *secondary = &ppu->secondary_oam[line];
 
-void addr_set(AddrRegister *addr, unsigned short data)
-{
-    addr->value[0] = (unsigned char)(data >> 8);
-    addr->value[1] = (unsigned char)(data & 0xFF);
-}
+    uint64_t        opaque[4];
 
-unsigned short addr_get(AddrRegister addr)
-{
-    return (unsigned short)(addr.value[0] << 8) | (unsigned short)addr.value[1];
-}
+    unsigned char   upper, 
+                    lower, 
+                    hits;
 
-void addr_update(AddrRegister *addr, unsigned char data)
-{
-    if (addr->hi_ptr)   addr->value[0] = data;
-    else                addr->value[1] = data;
-    
-    if (addr_get(*addr) > 0x3FFF)
-        addr_set(addr, addr_get(*addr) & 0x3FFF);
-    
-    addr->hi_ptr = !addr->hi_ptr;
+    if ((state->mask & (BACKGROUND_SHOW | SPRITES_SHOW)) != (BACKGROUND_SHOW | SPRITES_SHOW))
+        return -1;
+
+    // sprite 0 is always first in its lines' secondary oam
+    if (secondary->count == 0 || secondary->sprites[0] != 0)
+        return -1;
+
+    if (!ppu_sprite_row(ppu, ppu->oam_data, line, state, &upper, &lower))
+        return -1;
+
+    ppu_background_mask(ppu, line, opaque);
+
+    hits = (upper | lower) & ppu_mask_get8(opaque, ppu->oam_data[3]);
+
+    // the hit never happens on the last pixel of a line, whichever of the
+    // sprite's pixels lands there
+    if (ppu->oam_data[3] >= FRAME_WIDTH - 8)
+        hits &= ~(1 << (FRAME_WIDTH - 1 - ppu->oam_data[3]));
+
+    if (hits == 0)
+        return -1;
+
+    return ppu->oam_data[3] + __builtin_ctz(hits);
 }
 
-void addr_reset_latch(AddrRegister *addr)
+static unsigned char ppu_coarse_x_dots(unsigned short dot)
 {
-    addr->hi_ptr = true;
+    // number of coarse x increments up to and including this dot,
+    // every 8 dots from 8 to 256, then the prefetch at 328 and 336
+    if (dot < 8)        return 0;
+    if (dot <= 256)     return dot >> 3;
+    if (dot < 328)      return 32;
+    if (dot < 336)      return 33;
+    return 34;
 }
 
-void addr_increment(AddrRegister *addr, unsigned char inc)
+static void ppu_latch_scanline(PPU *ppu)
 {
-    unsigned char lo = addr->value[1];
-
-    addr->value[1] = (addr->value[1] + inc);
+    ScanlineState *state = &ppu->scanlines[ppu->scanline];
 
-    if (lo > addr->value[1])
-        addr->value[0] += 1;
+    state->v = ppu->v;
+    state->x = ppu->x;
+    state->ctrl = ppu->ctrl;
+    state->mask = ppu->mask;
 
-    if (addr_get(*addr) > 0x3FFF)
-        addr_set(addr, addr_get(*addr) & 0x3FFF);
-}
+    // the dot that outputs pixel x is x + 1, the flag is only set once a frame
+    ppu->sprite_0_hit_dot = -1;
 
-bool ppu_is_sprite_0_hit(PPU *ppu)
-{
-    unsigned char   y = ppu->oam_data[0], 
-                    x = ppu->oam_data[3];
+    if (!(ppu->status & SPRITE_0_HIT))
+    {
+        short hit_x = ppu_sprite_0_hit_x(ppu, ppu->scanline);
 
-    return (y == ppu->scanline) && (x <= ppu->cycles) && (ppu->mask & SPRITES_SHOW);
+        if (hit_x >= 0)
+            ppu->sprite_0_hit_dot = hit_x + 1;
+    }
 }
 
 bool ppu_tick(PPU *ppu, unsigned short cycles)
 {
-    ppu->cycles += cycles;
-    /*
-    if (ppu->cycles >= 1 && ppu->cycles <= 64)
-    {
-        
-    }
-    else if (ppu->cycles >= 65 && ppu->cycles <= 256)
-    {
-        //if (ppu->cycles % 2 == 0)
-        //{
-            
-        //}
-    }
-    else if (ppu->cycles >= 257 && ppu->cycles <= 320)
-    {
-        ppu->oam_addr = 0;
-    }
-    */
-    if (ppu->cycles >= 341)
+    bool new_frame = false;
+
+    while (cycles > 0)
     {
-        if (ppu_is_sprite_0_hit(ppu))
-            ppu->status |= SPRITE_0_HIT;
+        unsigned short  dot = ppu->cycles,
+                        next = 341;
 
-        ppu->cycles -= 341;
-        ppu->scanline += 1;
-        /*
-        if (ppu->scanline <= 241)
+        bool            rendering = (ppu->mask & (BACKGROUND_SHOW | SPRITES_SHOW))
+                                    && (ppu->scanline < FRAME_HEIGHT || ppu->scanline == 261);
+
+        // step to the next dot that touches v or sets the sprite 0 hit,
+        // or to the end of the line
+        if (dot < 256)          next = 256;
+        else if (dot < 257)     next = 257;
+        else if (dot < 260)     next = 260;
+        else if (dot < 304)     next = 304;
+
+        if (ppu->sprite_0_hit_dot > dot && ppu->sprite_0_hit_dot < next)
+            next = ppu->sprite_0_hit_dot;
+
+        if (next - dot > cycles)
+            next = dot + cycles;
+
+        cycles -= next - dot;
+        ppu->cycles = next;
+
+        if (rendering)
         {
-            ppu_render_scanline(ppu, ppu->frame->data);
+            ppu->v = ppu_coarse_x_add(ppu->v, ppu_coarse_x_dots(next) - ppu_coarse_x_dots(dot));
+
+            if (next == 256)
+                ppu->v = ppu_increment_y(ppu->v);
+            else if (next == 257)
+                ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+            else if (next == 304 && ppu->scanline == 261)
+                ppu->v = (ppu->v & ~0x7BE0) | (ppu->t & 0x7BE0);
+
+            // where the sprite fetches raise chr address line 12, which
+            // scanline counting mappers count
+            if (next == 260)
+                ppu->line_clocks++;
+        }
+
+        if (ppu->cycles == ppu->sprite_0_hit_dot)
+        {
+            ppu->status |= SPRITE_0_HIT;
+            ppu->sprite_0_hit_dot = -1;
         }
-        */
+
+        if (ppu->cycles < 341)
+            continue;
+
+        ppu->cycles = 0;
+        ppu->sprite_0_hit_dot = -1;
+        ppu->scanline += 1;
+
         if (ppu->scanline == 241)
         {
             ppu->status |= VERTICAL_BLANK;
@@ -1040,17 +1238,41 @@ bool ppu_tick(PPU *ppu, unsigned short cycles)
             ppu->nmi_write = false;
             ppu->status &= 0b10111111;
             ppu->status &= 0b01111111;
-            return true;
+            ppu->status &= 0b11011111;
+            new_frame = true;
+
+            ppu_evaluate_sprites(ppu);
+        }
+
+        if (ppu->scanline < FRAME_HEIGHT)
+        {
+            ppu_latch_scanline(ppu);
+
+            if (ppu->scanline == ppu->overflow_line 
+            && ppu->mask & (BACKGROUND_SHOW | SPRITES_SHOW))
+                ppu->status |= SPRITE_OVERFLOW;
         }
     }
 
-    return false;
+    return new_frame;
 }
 
-void ppu_load(PPU *ppu, unsigned char chr_rom[], enum Mirroring mirroring)
+void ppu_load(PPU *ppu, const unsigned char chr_rom[], unsigned char chr_ram[], unsigned int chr_len, enum Mirroring mirroring)
 {
     ppu->chr_rom = chr_rom;
-    ppu->mirroring = mirroring;
+    ppu->chr_ram = chr_ram;
+    ppu->chr_bank_count = (chr_ram ? CHR_RAM_SIZE : chr_len) >> 10;
+
+    if (chr_ram)
+        memset(chr_ram, 0, CHR_RAM_SIZE);
+
+    // the first 8 KB until the mapper says otherwise
+    for (int window = 0; window < 8; window++)
+        ppu->chr_bank_numbers[window] = window;
+
+    ppu_map_chr(ppu);
+
+    ppu->palette = &NES_PALETTE_RGBA;
 
     ppu->ctrl = 0;
     ppu->cycles = 0;
@@ -1061,14 +1283,15 @@ void ppu_load(PPU *ppu, unsigned char chr_rom[], enum Mirroring mirroring)
     ppu->oam_addr = 0;
     ppu->internal_data_buf = 0;
 
-    ppu->scroll.toggle = false;
-    ppu->scroll.x = 0;
-    ppu->scroll.y = 0;
+    ppu->v = 0;
+    ppu->t = 0;
+    ppu->x = 0;
+    ppu->w = false;
 
     ppu->nmi_interrupt = false;
     ppu->nmi_write = false;
 
-    for (int i = 0; i < 2048; i++)
+    for (int i = 0; i < sizeof(ppu->vram); i++)
         ppu->vram[i] = 0;
     
     for (int i = 0; i < 256; i++)
@@ -1076,6 +1299,51 @@ void ppu_load(PPU *ppu, unsigned char chr_rom[], enum Mirroring mirroring)
 
     for (int i = 0; i < 32; i++)
         ppu->palette_table[i] = 0;
+
+    memset(ppu->scanlines, 0, sizeof(ppu->scanlines));
+    ppu->dirty_pages = PPU_ALL_PAGES;
+    ppu->chr_dirty_pages = 0xFFFFFFFF;
+    ppu->line_clocks = 0;
+
+    ppu->sprite_no_limit = false;
+    ppu->sprite_0_hit_dot = -1;
+
+    memset(ppu->tile_palettes, 0, sizeof(ppu->tile_palettes));
+    memset(ppu->bg_pattern_dirty, 0, sizeof(ppu->bg_pattern_dirty));
+    ppu->bg_layer_bank = 0;
+    ppu->log = NULL;
+    ppu_set_mirroring(ppu, mirroring);
+    ppu_evaluate_sprites(ppu);
+}
+
+void ppu_set_chr_bank(PPU *ppu, unsigned char window, unsigned short bank)
+{
+    bank %= ppu->chr_bank_count;
+
+    if (ppu->chr_bank_numbers[window] == bank)
+        return;
+
+    ppu->chr_bank_numbers[window] = bank;
+    ppu->chr_banks[window] = &ppu->chr_rom[bank << 10];
+
+    // a 1 KB window holds 64 tiles, one word of the background's dirty tiles
+    if ((window << 10 & 0x1000) == ppu->bg_layer_bank)
+    {
+        ppu->bg_pattern_dirty[window & 0b11] = ~(uint64_t)0;
+        ppu->bg_dirty_any = true;
+    }
+
+    if (ppu->log)
+        ppu_log_write(ppu, PPU_LOG_CHR_BANK, bank, window);
+}
+
+void ppu_map_chr(PPU *ppu)
+{
+    // after chr_rom or the bank numbers changed underneath the windows
+    for (int window = 0; window < 8; window++)
+        ppu->chr_banks[window] = &ppu->chr_rom[ppu->chr_bank_numbers[window] << 10];
+
+    ppu_invalidate_background(ppu);
 }
 
 void ppu_write_to_ctrl(PPU *ppu, unsigned char value)
@@ -1083,6 +1351,7 @@ void ppu_write_to_ctrl(PPU *ppu, unsigned char value)
     unsigned char before_nmi_status = ppu->ctrl & GENERATE_NMI;
 
     ppu->ctrl = value;
+    ppu->t = (ppu->t & ~0x0C00) | ((unsigned short)(value & 0b11) << 10);
 
     if (!before_nmi_status 
     && ppu->ctrl & GENERATE_NMI 
@@ -1092,47 +1361,89 @@ void ppu_write_to_ctrl(PPU *ppu, unsigned char value)
     }
 }
 
+void ppu_write_to_scroll(PPU *ppu, unsigned char data)
+{
+    if (!ppu->w)
+    {
+        ppu->t = (ppu->t & ~0x001F) | (data >> 3);
+        ppu->x = data & 0b111;
+    }
+    else
+    {
+        ppu->t = (ppu->t & ~0x73E0) 
+                | ((unsigned short)(data & 0b111) << 12) 
+                | ((unsigned short)(data & 0b11111000) << 2);
+    }
+
+    ppu->w = !ppu->w;
+}
+
 void ppu_write_to_ppu_addr(PPU *ppu, unsigned char data)
 {
-    addr_update(&ppu->addr, data);
+    if (!ppu->w)
+    {
+        ppu->t = (ppu->t & 0x00FF) | ((unsigned short)(data & 0b00111111) << 8);
+    }
+    else
+    {
+        ppu->t = (ppu->t & 0x7F00) | data;
+        ppu->v = ppu->t;
+    }
+
+    ppu->w = !ppu->w;
+}
+
+unsigned char ppu_read_status(PPU *ppu)
+{
+    unsigned char status = ppu->status;
+
+    ppu->status &= 0b01111111;
+    ppu->w = false;
+
+    return status;
 }
 
 void ppu_increment_vram_addr(PPU *ppu)
 {
-    addr_increment(&ppu->addr, vram_addr_increment(ppu->ctrl));
+    ppu->v = (ppu->v + vram_addr_increment(ppu->ctrl)) & 0x7FFF;
 }
 
-unsigned short ppu_mirror_vram_addr(PPU *ppu, unsigned short addr)
+void ppu_set_mirroring(PPU *ppu, enum Mirroring mirroring)
 {
-    unsigned short  mirrored_vram = addr & 0b10111111111111,
-                    vram_index = mirrored_vram - 0x2000,
-                    name_table = vram_index / 0x400;
+    // physical 1 KB page behind each of the four logical nametables
+    static const unsigned char pages[5][4] = {
+        [VERTICAL]              = { 0, 1, 0, 1 },
+        [HORIZONTAL]            = { 0, 0, 1, 1 },
+        [FOUR_SCREEN]           = { 0, 1, 2, 3 },
+        [SINGLE_SCREEN_LOWER]   = { 0, 0, 0, 0 },
+        [SINGLE_SCREEN_UPPER]   = { 1, 1, 1, 1 }
+    };
 
-    unsigned short value = vram_index;
+    ppu->mirroring = mirroring;
 
-    switch (ppu->mirroring)
-    {
-        case VERTICAL:
-            if (name_table == 2 || name_table == 3)
-                value -= 0x800;
-            break;
-        case HORIZONTAL:
-            if (name_table == 1 || name_table == 2) 
-                value -= 0x400;
-            else if (name_table == 3)
-                value -= 0x800;
-            break;
-        case FOUR_SCREEN:
-        default:
-            break;
-    }
+    if (ppu->log)
+        ppu_log_write(ppu, PPU_LOG_MIRRORING, 0, mirroring);
+
+    for (int n = 0; n < 4; n++)
+        ppu->name_tables[n] = &ppu->vram[pages[mirroring][n] << 10];
+
+    ppu_invalidate_background(ppu);
+}
+
+unsigned char ppu_palette_idx(unsigned short addr)
+{
+    unsigned char idx = addr & 0x1F;
 
-    return value;
+    // $3F10/$3F14/$3F18/$3F1C mirror the background entries below them
+    if ((idx & 0x13) == 0x10)
+        idx &= 0x0F;
+
+    return idx;
 }
 
 unsigned char ppu_read_data(PPU *ppu)
 {
-    unsigned short addr = addr_get(ppu->addr);
+    unsigned short addr = ppu->v & 0x3FFF;
     unsigned char data = 0;
 
     ppu_increment_vram_addr(ppu);
@@ -1141,38 +1452,17 @@ unsigned char ppu_read_data(PPU *ppu)
     {
         case 0x0000 ... 0x1FFF:
             data = ppu->internal_data_buf;
-            ppu->internal_data_buf = ppu->chr_rom[addr];
+            ppu->internal_data_buf = ppu->chr_banks[addr >> 10][addr & 0x3FF];
             break;
         case 0x2000 ... 0x2FFF:
         case 0x3000 ... 0x3EFF:
             data = ppu->internal_data_buf;
-            ppu->internal_data_buf = ppu->vram[ppu_mirror_vram_addr(ppu, addr)];
-            break;
-        case 0x3F00 ... 0x3F09:
-        case 0x3F11 ... 0x3F13:
-        case 0x3F15 ... 0x3F17:
-        case 0x3F19 ... 0x3F1B:
-        case 0x3F1D ... 0x3F1F:
-            data = ppu->palette_table[addr - 0x3F00];
-            ppu->internal_data_buf = ppu->palette_table[addr - 0x3F00];
-            break;
-        case 0x3F10:
-        case 0x3F14:
-        case 0x3F18:
-        case 0x3F1C:
-            data = ppu->palette_table[addr - 0x10 - 0x3F00];
-            ppu->internal_data_buf = ppu->palette_table[addr - 0x10 - 0x3F00];
-            break;
-        case 0x3F20 ... 0x3FFF:
-            data = ppu->palette_table[addr % 32];
-            ppu->internal_data_buf = ppu->palette_table[addr % 32];
-            break;
-        /*
-        case 0x3F00 ... 0x3FFF: // this is technically incorrect
-            data = ppu->palette_table[addr % 32];
-            ppu->internal_data_buf = ppu->palette_table[addr % 32];
-            break;
-        */
+            ppu->internal_data_buf = ppu->name_tables[(addr >> 10) & 0b11][addr & 0x3FF];
+            break;
+        case 0x3F00 ... 0x3FFF:
+            data = ppu->palette_table[ppu_palette_idx(addr)];
+            ppu->internal_data_buf = data;
+            break;
         default:
             break;
     }
@@ -1182,38 +1472,42 @@ unsigned char ppu_read_data(PPU *ppu)
 
 void ppu_write_to_data(PPU *ppu, unsigned char data)
 {
-    unsigned short addr = addr_get(ppu->addr);
+    unsigned short  addr = ppu->v & 0x3FFF,
+                    vram_idx;
 
     switch (addr)
     {
         case 0x0000 ... 0x1FFF:
-            //write to RAM?
+            // chr rom ignores writes
+            if (!ppu->chr_ram)
+                break;
+
+            ppu_write_chr(ppu, addr, data);
+
+            if (ppu->log)
+                ppu_log_write(ppu, PPU_LOG_CHR, addr, data);
             break;
         case 0x2000 ... 0x2FFF:
         case 0x3000 ... 0x3EFF:
-            ppu->vram[ppu_mirror_vram_addr(ppu, addr)] = data;
-            break;
-        case 0x3F00 ... 0x3F09:
-        case 0x3F11 ... 0x3F13:
-        case 0x3F15 ... 0x3F17:
-        case 0x3F19 ... 0x3F1B:
-        case 0x3F1D ... 0x3F1F:
-            ppu->palette_table[addr - 0x3F00] = data;
-            break;
-        case 0x3F10:
-        case 0x3F14:
-        case 0x3F18:
-        case 0x3F1C:
-            ppu->palette_table[addr - 0x10 - 0x3F00] = data;
-            break;
-        case 0x3F20 ... 0x3FFF:
-            ppu->palette_table[addr % 32] = data;
+            vram_idx = (ppu->name_tables[(addr >> 10) & 0b11] - ppu->vram) | (addr & 0x3FF);
+
+            ppu->vram[vram_idx] = data;
+            ppu->dirty_pages |= 1 << (vram_idx >> 8);
+
+            if ((addr & 0x3FF) >= 0x3C0)
+                ppu_update_attribute(ppu, vram_idx);
+
+            ppu_invalidate_name_table(ppu, vram_idx);
+
+            if (ppu->log)
+                ppu_log_write(ppu, PPU_LOG_VRAM, vram_idx, data);
             break;
-        /*
-        case 0x3F00 ... 0x3FFF: // this is technically incorrect
-            ppu->palette_table[addr % 32] = data;
+        case 0x3F00 ... 0x3FFF:
+            ppu->palette_table[ppu_palette_idx(addr)] = data & 0x3F;
+
+            if (ppu->log)
+                ppu_log_write(ppu, PPU_LOG_PALETTE, ppu_palette_idx(addr), data & 0x3F);
             break;
-        */
         default:
             break;
     }
@@ -1221,24 +1515,34 @@ void ppu_write_to_data(PPU *ppu, unsigned char data)
     ppu_increment_vram_addr(ppu);
 }
 
-bool rom_load(Rom *rom, unsigned char data[])
+// points prg_rom and chr_rom into rom->image after checking the header
+static bool rom_parse(Rom *rom)
 {
-    if (data[0] != 'N' && data[1] != 'E' 
-    && data[2] != 'S'&& data[3] != 0x1A)
+    const unsigned char *data = rom->image;
+
+    if (rom->image_length < 16 || memcmp(data, "NES\x1A", 4) != 0)
     {
-        printf("File is not in iNES file format!\n");
+        fprintf(stderr, "File is not in iNES file format!\n");
         return false;
     }
 
     unsigned char ines_ver = (data[7] >> 2) & 0b11;
-    
+
     if (ines_ver != 0)
     {
-        printf("iNES2.0 format not supported!\nRunning in compatability mode.\n");
+        fprintf(stderr, "iNES2.0 format not supported!\nRunning in compatability mode.\n");
     }
-    
+
     rom->mapper = (data[7] & 0b11110000) | (data[6] >> 4);
 
+    if (!mapper_find(rom->mapper))
+    {
+        fprintf(stderr, "Mapper %d not supported!\n", rom->mapper);
+        return false;
+    }
+
+    fprintf(stderr, "mapper: %s\n", mapper_find(rom->mapper)->name);
+
     if (data[6] & 0b1000)   rom->screen_mirroring = FOUR_SCREEN;
     else if (data[6] & 0b1) rom->screen_mirroring = VERTICAL;
     else                    rom->screen_mirroring = HORIZONTAL;
@@ -1246,62 +1550,176 @@ bool rom_load(Rom *rom, unsigned char data[])
     rom->prg_len = data[4] * PRG_ROM_PAGE_SIZE;
     rom->chr_len = data[5] * CHR_ROM_PAGE_SIZE;
 
-    printf("nr kb prg banks:%d\nnr kb chr banks:%d\n", data[4], data[5]);
+    fprintf(stderr, "nr kb prg banks:%d\nnr kb chr banks:%d\n", data[4], data[5]);
+
+    fprintf(stderr, "prg size: %d chr size: %d\n", rom->prg_len, rom->chr_len);
 
-    printf("prg size: %d chr size: %d\n", rom->prg_len, rom->chr_len);
+                            // check if trainer is set, else skip
+    size_t  prg_rom_start = (data[6] & 0b100) ? 512 + 16 : 16,
+            chr_rom_start = prg_rom_start + rom->prg_len;
 
-                                    // check if trainer is set, else skip
-    unsigned short  prg_rom_start = (data[6] & 0b100) ? 512 + 16 : 16,
-                    chr_rom_start = prg_rom_start + rom->prg_len;
+    fprintf(stderr, "prg start: %zu chr start: %zu\n", prg_rom_start, chr_rom_start);
 
-    printf("prg start: %d chr start: %d\n", prg_rom_start, chr_rom_start);
+    if (!rom->prg_len || chr_rom_start + rom->chr_len > rom->image_length)
+    {
+        fprintf(stderr, "File is shorter than its header says!\n");
+        return false;
+    }
 
-    rom->prg_rom = malloc(rom->prg_len);
-    rom->chr_rom = malloc(rom->chr_len);
+    rom->prg_rom = &data[prg_rom_start];
+    rom->chr_rom = &data[chr_rom_start];
 
-    int i = 0;
+    fprintf(stderr, "Rom loaded successfully!\n");
 
-    for (; i < rom->prg_len; i++)
-        rom->prg_rom[i] = data[prg_rom_start + i];
-    
-    for (i = 0; i < rom->chr_len; i++)
-        rom->chr_rom[i] = data[chr_rom_start + i];
+    return true;
+}
+
+static bool rom_has_prg_ram(const Rom *rom)
+{
+    return rom->image[6] & 0b10 || rom->mapper;
+}
+
+// the ram on the cart, never shared between machines
+static bool rom_alloc_ram(Rom *rom)
+{
+    if (!rom->chr_len)
+    {
+        rom->chr_ram = calloc(1, CHR_RAM_SIZE);
+        rom->chr_rom = rom->chr_ram;
+    }
+
+    if (rom_has_prg_ram(rom))
+        rom->prg_ram = calloc(1, PRG_RAM_SIZE);
+
+    if ((!rom->chr_len && !rom->chr_ram) || (rom_has_prg_ram(rom) && !rom->prg_ram))
+    {
+        fprintf(stderr, "could not allocate cartridge ram!\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool rom_load(Rom *rom, const unsigned char data[], size_t length)
+{
+    unsigned char *image = malloc(length);
+
+    rom_reset(rom);
+
+    if (!image)
+    {
+        fprintf(stderr, "could not allocate rom!\n");
+        return false;
+    }
+
+    // one copy of the file, prg and chr are read from it in place
+    memcpy(image, data, length);
+    rom->image = image;
+    rom->image_length = length;
+
+    if (!rom_parse(rom) || !rom_alloc_ram(rom))
+    {
+        rom_reset(rom);
+        return false;
+    }
+
+    return true;
+}
+
+bool rom_map(Rom *rom, const char *filename)
+{
+    struct stat info;
+    int         fd = open(filename, O_RDONLY);
+
+    rom_reset(rom);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open file!\n");
+        return false;
+    }
+
+    if (fstat(fd, &info) < 0 || info.st_size == 0)
+    {
+        fprintf(stderr, "Could not read file!\n");
+        close(fd);
+        return false;
+    }
+
+    // nothing is read up front, and every machine mapping the same file
+    // shares its pages through the page cache
+    void *image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    printf("Rom loaded successfully!\n");
+    if (image == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map file!\n");
+        return false;
+    }
+
+    rom->image = image;
+    rom->image_length = info.st_size;
+    rom->mapped = true;
+
+    if (!rom_parse(rom) || !rom_alloc_ram(rom))
+    {
+        rom_reset(rom);
+        return false;
+    }
+
+    return true;
+}
+
+bool rom_share(Rom *rom, const Rom *source)
+{
+    rom_reset(rom);
+
+    // same image, but each machine gets its own cart ram
+    *rom = *source;
+    rom->borrowed = true;
+    rom->chr_ram = NULL;
+    rom->prg_ram = NULL;
+
+    if (!rom_alloc_ram(rom))
+    {
+        rom_reset(rom);
+        return false;
+    }
 
     return true;
 }
 
 unsigned char rom_read_prg_rom(Bus *bus, unsigned short addr)
 {
-    addr -= 0x8000;
+    return bus->prg_banks[(addr >> 13) & 0b11][addr & 0x1FFF];
+}
 
-    if (bus->rom.prg_len == 0x4000 && addr >= 0x4000)
-        addr %= 0x4000;
-    
-    return bus->rom.prg_rom[addr];
+void bus_set_callback(Bus *bus, FrameCallback callback, void *data)
+{
+    bus->frame_callback = callback;
+    bus->callback_data = data;
 }
 
 void bus_tick(Bus *bus, unsigned short cycles)
 {
     bus->cycles += cycles;
 
-    unsigned char nmi_before = bus->ppu.nmi_interrupt;
+    unsigned short line_before = bus->ppu.scanline;
 
     ppu_tick(&bus->ppu, cycles * 3);
 
-    unsigned char nmi_after = bus->ppu.nmi_interrupt;
+    if (bus->ppu.line_clocks)
+        mapper_clock_lines(bus);
 
-    if (!nmi_before && nmi_after)
-        cpu_callback(bus);
+    // the NMI edge would never come for games that poll $2002 instead
+    if (line_before < 241 && bus->ppu.scanline >= 241 && bus->frame_callback)
+        bus->frame_callback(bus, bus->callback_data);
 }
 
 void bus_free_rom(Rom *rom)
 {
-    printf("free chr rom\n");
-    free(rom->chr_rom);
-    printf("free prg rom\n");
-    free(rom->prg_rom);
+    printf("free rom\n");
+    rom_reset(rom);
 }
 
 unsigned char bus_mem_read(Bus *bus, unsigned short addr)
@@ -1327,13 +1745,10 @@ unsigned char bus_mem_read(Bus *bus, unsigned short addr)
             break;
         case 0x4017:
             // joypad2
-            //mem_addr = joypad_read(&bus->joypad2);
+            mem_addr = joypad_read(&bus->joypad2);
             break;
         case 0x2002:
-            mem_addr = bus->ppu.status;
-            bus->ppu.status &= 0b01111111;
-            bus->ppu.addr.hi_ptr = true;
-            bus->ppu.scroll.toggle = false;
+            mem_addr = ppu_read_status(&bus->ppu);
             break;
         case 0x2004:
             mem_addr = bus->ppu.oam_data[bus->ppu.oam_addr];
@@ -1347,6 +1762,10 @@ unsigned char bus_mem_read(Bus *bus, unsigned short addr)
         case 0x4015:
             mem_addr = bus->apu.status;
             break;
+        case 0x6000 ... 0x7FFF:
+            if (bus->rom.prg_ram)
+                mem_addr = bus->rom.prg_ram[addr - 0x6000];
+            break;
         case 0x8000 ... 0xFFFF:
             mem_addr = rom_read_prg_rom(bus, addr);
             break;
@@ -1364,6 +1783,7 @@ void bus_mem_write(Bus *bus, unsigned short addr, unsigned char data)
     {
         case RAM ... RAM_MIRRORS_END:
             bus->cpu_vram[addr & 0x7FF] = data;
+            bus->dirty_pages |= 1 << ((addr & 0x7FF) >> 8);
             break;
         case PPU_REGISTERS:
             //if (bus->cycles >= 29658)
@@ -1380,25 +1800,24 @@ void bus_mem_write(Bus *bus, unsigned short addr, unsigned char data)
             //if (!(bus->ppu.scanline >= 0 && bus->ppu.scanline <= 239))
             //{
                 bus->ppu.oam_data[bus->ppu.oam_addr] = data;
+                bus->ppu.dirty_pages |= PPU_OAM_PAGE;
+
+                if (bus->ppu.log)
+                    ppu_log_write(&bus->ppu, PPU_LOG_OAM, bus->ppu.oam_addr, data);
+
                 bus->ppu.oam_addr++;
             //}
             break;
         case 0x2005:
             //if (bus->cycles >= 29658)
             //{
-                if (!bus->ppu.scroll.toggle)
-                    bus->ppu.scroll.x = data;
-                else 
-                    bus->ppu.scroll.y = data;
-                
-                bus->ppu.scroll.toggle = !bus->ppu.scroll.toggle;
+                ppu_write_to_scroll(&bus->ppu, data);
             //}
             break;
         case 0x2006:
             //if (bus->cycles >= 29658)
             //{
                 ppu_write_to_ppu_addr(&bus->ppu, data);
-                bus->ppu.scroll.toggle = !bus->ppu.scroll.toggle;
             //}
             break;
         case 0x2007:
@@ -1499,9 +1918,15 @@ void bus_mem_write(Bus *bus, unsigned short addr, unsigned char data)
             //{
                 unsigned short hi = (unsigned short)data << 8;
 
+                bus->ppu.dirty_pages |= PPU_OAM_PAGE;
+
                 for (int i = 0; i < 256; i++)
                 {
                     bus->ppu.oam_data[bus->ppu.oam_addr] = bus_mem_read(bus, hi + i);
+
+                    if (bus->ppu.log)
+                        ppu_log_write(&bus->ppu, PPU_LOG_OAM, bus->ppu.oam_addr, bus->ppu.oam_data[bus->ppu.oam_addr]);
+
                     bus->ppu.oam_addr++;
                 }
 
@@ -1513,14 +1938,23 @@ void bus_mem_write(Bus *bus, unsigned short addr, unsigned char data)
             //}
             break;
         case 0x4016:
-            // joypad write
+            // joypad write, the strobe goes to both ports
             joypad_write(&bus->joypad1, data);
+            joypad_write(&bus->joypad2, data);
             break;
         case 0x2008 ... PPU_REGISTERS_END:
             bus_mem_write(bus, addr & 0x2007, data);
             break;
+        case 0x6000 ... 0x7FFF:
+            if (bus->rom.prg_ram)
+            {
+                bus->rom.prg_ram[addr - 0x6000] = data;
+                bus->prg_ram_dirty_pages |= (uint32_t)1 << ((addr - 0x6000) >> 8);
+            }
+            break;
         case 0x8000 ... 0xFFFF:
-            // Attempt to write to cartridge ROM space!
+            // rom itself is never written, the mapper may switch banks
+            mapper_write(bus, addr, data);
             break;
         default: 
         case 0x2002:
@@ -1617,30 +2051,33 @@ void rom_init(Rom *rom)
     rom->chr_len = 0;
     rom->prg_len = 0;
 
+    rom->image = NULL;
+    rom->image_length = 0;
     rom->chr_rom = NULL;
     rom->prg_rom = NULL;
+    rom->chr_ram = NULL;
+    rom->prg_ram = NULL;
+    rom->mapped = false;
+    rom->borrowed = false;
 }
 
 void rom_reset(Rom *rom)
 {
-    if (rom->chr_rom != NULL)
-    {
-        free(rom->chr_rom);
-        rom->chr_rom = NULL;
-    }
-    if (rom->prg_rom != NULL)
+    if (rom->image && !rom->borrowed)
     {
-        free(rom->prg_rom);
-        rom->prg_rom = NULL;
+        if (rom->mapped)
+            munmap((void *)rom->image, rom->image_length);
+        else
+            free((void *)rom->image);
     }
 
-    rom->screen_mirroring = 0;
-    rom->mapper = 0;
-    rom->chr_len = 0;
-    rom->prg_len = 0;
+    free(rom->chr_ram);
+    free(rom->prg_ram);
+
+    rom_init(rom);
 }
 
-void cpu_interrupt_nmi(CPU *cpu)
+static void cpu_interrupt(CPU *cpu, unsigned short vector)
 {
     cpu_mem_write_u16(cpu, 0x0100 + cpu->stack_pointer - 1, cpu->program_counter);
     cpu->stack_pointer -= 2;
@@ -1658,7 +2095,17 @@ void cpu_interrupt_nmi(CPU *cpu)
     cpu->cycles += 2;
     bus_tick(&cpu->bus, 2);
 
-    cpu->program_counter = cpu_mem_read_u16(cpu, 0xFFFA);
+    cpu->program_counter = cpu_mem_read_u16(cpu, vector);
+}
+
+void cpu_interrupt_nmi(CPU *cpu)
+{
+    cpu_interrupt(cpu, 0xFFFA);
+}
+
+void cpu_interrupt_irq(CPU *cpu)
+{
+    cpu_interrupt(cpu, 0xFFFE);
 }
 
 void cpu_init(CPU *cpu)
@@ -1666,15 +2113,24 @@ void cpu_init(CPU *cpu)
     for (int i = 0; i < 2048; i++)
         cpu->bus.cpu_vram[i] = 0;
 
+    cpu->bus.dirty_pages = 0xFF;
+    cpu->bus.prg_ram_dirty_pages = 0xFFFFFFFF;
+
     cpu->register_a = 0;
     cpu->register_x = 0;
     cpu->register_y = 0;
     cpu->status = 0x24;
     cpu->stack_pointer = 0xFD;     
+
+    // the reset vector is read through the banks the cart powers on with
+    mapper_reset(&cpu->bus);
+
     cpu->program_counter = cpu_mem_read_u16(cpu, 0xFFFC);
     cpu->cycles = 0;
     cpu->bus.cycles = 0;
-    cpu->bus.prg_rom = cpu->bus.rom.prg_rom;
+
+    // frontends register theirs after this
+    bus_set_callback(&cpu->bus, NULL, NULL);
 }
 
 void cpu_reset(CPU *cpu)
@@ -3084,6 +3540,9 @@ void cpu_interpret(CPU *cpu)
         cpu_interrupt_nmi(cpu);
         cpu->bus.ppu.nmi_write = true;
     }
+    // the mapper holds irq low until it is acknowledged
+    else if (cpu->bus.mapper.irq_pending && !(cpu->status & Interrupt_Disable_Flag))
+        cpu_interrupt_irq(cpu);
 
     unsigned char   //program_counter_state = 0,
                     opcode_cycles = 0,
@@ -4541,50 +5000,23 @@ void e_file_handler(unsigned char *buffer, int len)
 
 void test_format_mem_access(const char *filename)
 {
-    FILE *f;
-
-    f = fopen(filename, "r");
-
-    if (!f)
-    {
-        printf("Could not open file!\n");
-        return;
-    }
-
-    unsigned char *file_buffer;
-    int i = 0;
-
-    file_buffer = malloc(40976);
-
-    while (!feof(f))
-    {
-        file_buffer[i] = fgetc(f);
-        i++;
-    }
-
-    fclose(f);
-    
     CPU cpu;
 
     printf("reset rom\n");
     rom_init(&cpu.bus.rom);
 
     printf("rom load\n");
-    if (!rom_load(&cpu.bus.rom, file_buffer))
+    if (!rom_map(&cpu.bus.rom, filename))
     {
-        printf("Could not load file buffer!\n");
+        printf("Could not load file!\n");
         return;
     }
 
     printf("reset cpu\n");
+    ppu_load(&cpu.bus.ppu, cpu.bus.rom.chr_rom, cpu.bus.rom.chr_ram, cpu.bus.rom.chr_len, cpu.bus.rom.screen_mirroring);
     cpu_init(&cpu);
-    ppu_load(&cpu.bus.ppu, cpu.bus.rom.chr_rom, cpu.bus.rom.screen_mirroring);
-    addr_reset(&cpu.bus.ppu.addr);
 
     cpu_test(&cpu);
 
-    printf("free file buffer\n");
-    free(file_buffer);
-
     bus_free_rom(&cpu.bus.rom);
 }
@@ -1,13 +1,18 @@
+#ifndef EMU_H
+#define EMU_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
-
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
+#include <stdint.h>
+#include <math.h>
 
 #define PRG_ROM_PAGE_SIZE   0x4000
 #define CHR_ROM_PAGE_SIZE   0x2000
+// carts without chr rom get this much chr ram, ones with a battery or a mapper get prg ram
+#define CHR_RAM_SIZE        0x2000
+#define PRG_RAM_SIZE        0x2000
 
 #define STACK_RESET         0x01FF
 #define RAM                 0x0000
@@ -17,18 +22,22 @@ typedef unsigned short uint16_t;
 
 #define FRAME_WIDTH         256 
 #define FRAME_HEIGHT        240
-// value of width * height * 3
-#define FRAME_LENGTH        184320
-// width of frame width * 3 = 256 * 3
-#define FRAME_PITCH         768
+// value of width * height, one RGBA32 pixel each
+#define FRAME_LENGTH        61440
+// width of frame in bytes = 256 * 4
+#define FRAME_PITCH         1024
 
-#define TEST_FRAME_LENGTH   61440 
+// the four logical nametables including rows 30 and 31 that v can address
+#define BG_LAYER_WIDTH      512
+#define BG_LAYER_HEIGHT     512
 
 enum Mirroring
 {
     VERTICAL,
     HORIZONTAL,
-    FOUR_SCREEN
+    FOUR_SCREEN,
+    SINGLE_SCREEN_LOWER,
+    SINGLE_SCREEN_UPPER
 };
 
 enum ProcessorStatus
@@ -96,7 +105,18 @@ enum PPUStatusRegister
 };
 
 // 64 * 3 RGB format
-extern uint8_t NES_PALETTE[192];
+extern const uint8_t NES_PALETTE[192];
+
+// packed so the bytes read R, G, B, A with GL_UNSIGNED_INT_8_8_8_8_REV
+#define PALETTE_RGBA(r, g, b)   (0xFF000000u | (uint32_t)(b) << 16 | (uint32_t)(g) << 8 | (uint32_t)(r))
+
+typedef struct NesPalette
+{
+    // 64 colours for each combination of the emphasis bits
+    uint32_t        rgba[8][64];
+} NesPalette;
+
+extern const NesPalette NES_PALETTE_RGBA;
 
 enum JoypadButton
 {
@@ -215,28 +235,71 @@ typedef struct Rect
     short   x1, y1, x2, y2;
 } Rect;
 
-typedef struct Palette
-{
-    unsigned char   p1, p2, p3, p4;
-} Palette;
-
 typedef struct Frame
 {
-    unsigned char   data[FRAME_LENGTH];
+    uint32_t        data[FRAME_LENGTH];
 } Frame;
 
-typedef struct AddrRegister
+typedef struct FrameSkip
+{
+    // draw one frame out of every interval, 0 only draws requested frames
+    unsigned char   interval, count;
+    bool            requested;
+} FrameSkip;
+
+typedef struct ScanlineState
+{
+    // v and fine x as latched at the start of a visible line
+    unsigned short  v;
+    unsigned char   x, ctrl, mask;
+} ScanlineState;
+
+typedef struct SecondaryOAM
+{
+    // oam indices of the sprites on one line, lowest index first
+    unsigned char   count, sprites[64];
+} SecondaryOAM;
+
+enum PpuLogTarget
 {
-    // high byte first, low second
-    unsigned char   value[2];
-    bool            hi_ptr:1;
-} AddrRegister;
+    PPU_LOG_VRAM,
+    PPU_LOG_PALETTE,
+    PPU_LOG_OAM,
+    PPU_LOG_CHR,
+    PPU_LOG_MIRRORING,
+    PPU_LOG_CHR_BANK
+};
 
-typedef struct ScrollRegister
+typedef struct PpuWrite
 {
-    unsigned char   x, y;
-    bool            toggle:1;
-} ScrollRegister;
+    // addr is a vram, palette, oam or chr index depending on target,
+    // for a chr bank it is the bank and value the 1 KB window
+    unsigned short  addr;
+    unsigned char   target, value,
+                    line;   // 0 for vblank, else the visible line it follows + 1
+} PpuWrite;
+
+// bits of PPU.dirty_pages, one per 256 byte page of vram and one for oam
+#define PPU_OAM_PAGE        0x10000
+#define PPU_ALL_PAGES       0x1FFFF
+
+// writes a frame of PPU memory to replay it on the render thread
+#define PPU_LOG_LENGTH      16384
+
+typedef struct PpuWriteLog
+{
+    unsigned int    count;
+    bool            overflow:1, render:1;
+
+    PpuWrite        writes[PPU_LOG_LENGTH];
+    ScanlineState   scanlines[FRAME_HEIGHT];
+
+    // render memory at the end of the frame, only filled in after an overflow
+    unsigned char   vram[4096], palette_table[32], oam_data[256],
+                    chr_ram[CHR_RAM_SIZE];
+    unsigned short  chr_bank_numbers[8];
+    enum Mirroring  mirroring;
+} PpuWriteLog;
 
 typedef struct AudioProcessingUnit
 {
@@ -251,52 +314,136 @@ typedef struct AudioProcessingUnit
 
 typedef struct PPU
 {
-    unsigned char           *chr_rom,
+    // chr_ram is the same memory as chr_rom on carts that can write it
+    const unsigned char     *chr_rom;
+
+    // 1 KB windows of the pattern tables into chr_rom, switched by the mapper
+    const unsigned char     *chr_banks[8];
+    unsigned short          chr_bank_numbers[8], chr_bank_count;
+
+    unsigned char           *chr_ram,
                             palette_table[32],
-                            vram[2048],
+                            vram[4096],     // upper 2 KB only for four-screen carts
                             oam_data[256],
                             oam_addr,
                             internal_data_buf,
                             latch;
 
-    bool                    nmi_interrupt:1, nmi_write:1;
+    bool                    nmi_interrupt:1, nmi_write:1, w:1,
+                            sprite_no_limit:1;
 
     unsigned short          scanline, cycles;
 
     enum Mirroring          mirroring;
+
+    // the four logical nametables, only changed by ppu_set_mirroring
+    unsigned char           *name_tables[4];
     enum PPUControlRegister ctrl;
     enum PPUMaskRegister    mask;
     enum PPUStatusRegister  status;
 
-    AddrRegister            addr;
-    ScrollRegister          scroll;
+    // loopy registers: current and temporary vram address, fine x scroll
+    unsigned short          v, t;
+    unsigned char           x;
+
+    ScanlineState           scanlines[FRAME_HEIGHT];
+
+    // sprites per line from one pass over oam_data at the start of a frame
+    SecondaryOAM            secondary_oam[FRAME_HEIGHT];
+    unsigned char           sprite_height, sprite_y[64];
+    short                   overflow_line, sprite_0_hit_dot;
+
+    // background of all four nametables as palette_table indices, only the
+    // tiles marked dirty get redrawn before a line is copied out of it
+    unsigned char           bg_layer[BG_LAYER_HEIGHT][BG_LAYER_WIDTH];
+    uint32_t                bg_dirty[4][32];
+    uint64_t                bg_pattern_dirty[4];
+    unsigned short          bg_layer_bank;
+    bool                    bg_dirty_any;
+
+    // attribute palette number of every tile, kept in step with $2007 writes
+    unsigned char           tile_palettes[4][1024];
+
+    const NesPalette        *palette;
+
+    // writes are recorded here when a render thread replays the frame
+    PpuWriteLog             *log;
+
+    // pages written since the last clone, see clone.c
+    uint32_t                dirty_pages, chr_dirty_pages;
+
+    // rendered lines that passed dot 260 since the mapper last looked
+    unsigned char           line_clocks;
 
     Frame                   *frame;
 } PPU;
 
 typedef struct Rom
 {
-    unsigned char   *prg_rom,
-                    *chr_rom,
+    // the whole .nes file, prg_rom and chr_rom point into it
+    const unsigned char *image,
+                        *prg_rom,
+                        *chr_rom;
+
+    size_t          image_length;
+
+    // per machine even when the image is shared, NULL when the cart has none
+    unsigned char   *chr_ram,
+                    *prg_ram,
                     mapper;
 
-    unsigned short  prg_len, chr_len;
+    unsigned int    prg_len, chr_len;
 
     enum Mirroring  screen_mirroring;
+
+    // image is a read only mmap of the file instead of a malloc'd copy,
+    // borrowed when it belongs to another Rom and is not freed here
+    bool            mapped:1, borrowed:1;
 } Rom;
 
-typedef struct Bus
+// bank registers of the cart, which ones mean anything depends on the mapper;
+// bytes only so they can be saved and hashed as they are
+typedef struct Mapper
 {
-    unsigned char   cpu_vram[2048],
-                    *prg_rom;
+    // mmc1 serial port and control, registers holds its chr 0, chr 1 and
+    // prg registers, or the one bank register of UxROM and CNROM
+    unsigned char   shift, shift_count, control, registers[8];
+
+    // mmc3 bank select and scanline counter, registers holds R0-R7
+    unsigned char   select, irq_latch, irq_counter, irq_enabled, irq_reload, irq_pending;
+} Mapper;
+
+typedef struct Bus Bus;
+typedef struct MapperType MapperType;
+
+// called once a frame when the PPU enters vblank, whether or not the game
+// has NMI enabled
+typedef void (*FrameCallback)(Bus *bus, void *data);
+
+struct Bus
+{
+    unsigned char   cpu_vram[2048];
+
+    // 8 KB windows of $8000-$FFFF into the prg rom, switched by the mapper
+    const unsigned char *prg_banks[4];
+
+    const MapperType    *mapper_type;
+    Mapper              mapper;
 
     unsigned int    cycles;
 
+    // 256 byte pages of cpu_vram and of prg ram written since the last clone
+    unsigned char   dirty_pages;
+    uint32_t        prg_ram_dirty_pages;
+
     Joypad joypad1, joypad2;
     Rom rom;
     PPU ppu;
     APU apu;
-} Bus;
+
+    FrameCallback   frame_callback;
+    void            *callback_data;
+};
 
 typedef struct CPU
 {
@@ -323,59 +470,70 @@ void joypad_init(Joypad *joypad);
 void joypad_write(Joypad *joypad, uint8_t data);
 uint8_t joypad_read(Joypad *joypad);
 
+void palette_from_rgb(NesPalette *palette, const uint8_t rgb[192]);
+bool palette_load(NesPalette *palette, const char *filename);
+void palette_generate(NesPalette *palette, float saturation, float hue);
+
 void frame_init(Frame *frame);
-void frame_set_pixel(uint8_t frame[], short x, short y, uint8_t rgb[3]);
 
-Palette bg_palette(PPU *ppu, uint8_t *attr_table, uint8_t tile_column, uint8_t tile_row);
-Palette ppu_sprite_palette(PPU *ppu, uint8_t palette_idx);
+void frameskip_init(FrameSkip *skip, uint8_t interval);
+void frameskip_request(FrameSkip *skip);
+bool frameskip_next(FrameSkip *skip);
 
-void ppu_render_name_table(PPU *ppu, 
-                            Frame *frame, 
-                            uint8_t test_frame[],
-                            uint8_t *name_table, 
-                            Rect viewport, 
-                            short shift_x, 
-                            short shift_y);
+uint16_t ppu_coarse_x_add(uint16_t v, short n);
+uint16_t ppu_increment_y(uint16_t v);
 
 void ppu_render(PPU *ppu, Frame *frame);
-
-void ppu_render_scanline_sprite(PPU *ppu, uint8_t frame[], uint8_t test[]);
-void ppu_render_scanline_nametable(PPU *ppu,
-                                        unsigned char vfb[], 
-                                        unsigned char *name_table, 
-                                        Rect viewport,
-                                        short shift_x, 
-                                        short shift_y);
-
-void ppu_render_scanline(PPU *ppu, uint8_t frame[]);
-
-extern void cpu_callback(Bus *bus);
+void ppu_log_write(PPU *ppu, enum PpuLogTarget target, uint16_t addr, uint8_t value);
+void ppu_log_close(PPU *ppu);
+void ppu_apply_write(PPU *ppu, const PpuWrite *write);
+void ppu_render_log(PPU *ppu, const PpuWriteLog *log, Frame *frame);
+
+void ppu_evaluate_sprites(PPU *ppu);
+void ppu_evaluate_sprite_lines(PPU *ppu);
+const uint8_t *ppu_sprite_tile_row(PPU *ppu, uint8_t *sprite, short row, uint8_t ctrl);
+uint8_t ppu_mask_get8(const uint64_t mask[4], short x);
+void ppu_mask_set8(uint64_t mask[4], short x, uint8_t bits);
+bool ppu_sprite_row(PPU *ppu, uint8_t *sprite, short line, ScanlineState *state, uint8_t *upper, uint8_t *lower);
+
+void ppu_invalidate_background(PPU *ppu);
+void ppu_invalidate_name_table(PPU *ppu, uint16_t vram_idx);
+void ppu_update_attributes(PPU *ppu);
+void ppu_update_attribute(PPU *ppu, uint16_t vram_idx);
+void ppu_invalidate_pattern(PPU *ppu, uint16_t addr);
+void ppu_refresh_background(PPU *ppu, uint16_t bank);
+
+void ppu_background_mask(PPU *ppu, short line, uint64_t opaque[4]);
+void ppu_render_scanline_sprite(PPU *ppu, uint32_t pixels[], const uint32_t colors[32], uint64_t opaque[4], short line);
+void ppu_render_scanline_nametable(PPU *ppu, uint32_t pixels[], const uint32_t colors[32], uint64_t opaque[4], short line);
+void ppu_render_scanline(PPU *ppu, uint32_t frame[], short line);
 
 uint8_t vram_addr_increment(enum PPUControlRegister ctrl);
 
-void addr_reset(AddrRegister *addr);
-void addr_set(AddrRegister *addr, uint16_t data);
-uint16_t addr_get(AddrRegister addr);
-void addr_update(AddrRegister *addr, uint8_t data);
-void addr_reset_latch(AddrRegister *addr);
-void addr_increment(AddrRegister *addr, uint8_t inc);
-
-bool ppu_is_sprite_0_hit(PPU *ppu);
+short ppu_sprite_0_hit_x(PPU *ppu, short line);
 bool ppu_tick(PPU *ppu, uint16_t cycles);
-void ppu_load(PPU *ppu, uint8_t chr_rom[], enum Mirroring mirroring);
+void ppu_load(PPU *ppu, const uint8_t chr_rom[], uint8_t chr_ram[], unsigned int chr_len, enum Mirroring mirroring);
+void ppu_set_chr_bank(PPU *ppu, uint8_t window, uint16_t bank);
+void ppu_map_chr(PPU *ppu);
 void ppu_write_to_ctrl(PPU *ppu, uint8_t value);
+void ppu_write_to_scroll(PPU *ppu, uint8_t data);
 void ppu_write_to_ppu_addr(PPU *ppu, uint8_t data);
+uint8_t ppu_read_status(PPU *ppu);
 void ppu_increment_vram_addr(PPU *ppu);
-uint16_t ppu_mirror_vram_addr(PPU *ppu, uint16_t addr);
+void ppu_set_mirroring(PPU *ppu, enum Mirroring mirroring);
+uint8_t ppu_palette_idx(uint16_t addr);
 uint8_t ppu_read_data(PPU *ppu);
 void ppu_write_to_data(PPU *ppu, uint8_t data);
 
-bool rom_load(Rom *rom, uint8_t data[]);
+bool rom_load(Rom *rom, const uint8_t data[], size_t length);
+bool rom_map(Rom *rom, const char *filename);
+bool rom_share(Rom *rom, const Rom *source);
 void rom_init(Rom *rom);
 void rom_reset(Rom *rom);
 
 uint8_t rom_read_prg_rom(Bus *bus, uint16_t addr);
 
+void bus_set_callback(Bus *bus, FrameCallback callback, void *data);
 void bus_tick(Bus *bus, uint16_t cycles);
 void bus_free_rom(Rom *rom);
 uint8_t bus_mem_read(Bus *bus, uint16_t addr);
@@ -399,6 +557,7 @@ void cpu_zero_set(enum ProcessorStatus *status);
 void cpu_clv(enum ProcessorStatus *status);
 
 void cpu_interrupt_nmi(CPU *cpu);
+void cpu_interrupt_irq(CPU *cpu);
 void cpu_init(CPU *cpu);
 void cpu_reset(CPU *cpu);
 
@@ -483,3 +642,5 @@ void cpu_test(CPU *cpu);
 void e_file_handler(unsigned char *buffer, int len);
 
 void test_format_mem_access(const char *filename);
+
+#endif
@@ -0,0 +1,182 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "export.h"
+
+// the header and every slot start on their own cache line
+#define EXPORT_ALIGN        64
+#define EXPORT_SLOT_SIZE    ((sizeof(ExportSlot) + EXPORT_ALIGN - 1) & ~(size_t)(EXPORT_ALIGN - 1))
+
+static uint64_t export_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void export_set_name(Export *export, const char *name)
+{
+    snprintf(export->name, sizeof(export->name), "%s", name);
+}
+
+bool export_create(Export *export, const char *name, unsigned int slot_count)
+{
+    if (!slot_count)
+        slot_count = 1;
+
+    export->size = EXPORT_ALIGN + slot_count * EXPORT_SLOT_SIZE;
+    export->owner = true;
+    export->last_publish = 0;
+    export_set_name(export, name);
+
+    // a stale object from an earlier run may have another size
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+
+    if (fd < 0)
+    {
+        printf("could not create shared memory %s!\n", name);
+        return false;
+    }
+
+    if (ftruncate(fd, export->size) < 0)
+    {
+        printf("could not size shared memory %s!\n", name);
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+
+    export->shared = mmap(NULL, export->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (export->shared == MAP_FAILED)
+    {
+        printf("could not map shared memory %s!\n", name);
+        export->shared = NULL;
+        shm_unlink(name);
+        return false;
+    }
+
+    // ftruncate zeroed it, so every slot starts out even and empty
+    export->shared->version = EXPORT_VERSION;
+    export->shared->slot_count = slot_count;
+    export->shared->slot_size = EXPORT_SLOT_SIZE;
+    atomic_store(&export->shared->written, 0);
+
+    // readers check the magic last
+    atomic_thread_fence(memory_order_release);
+    export->shared->magic = EXPORT_MAGIC;
+
+    return true;
+}
+
+bool export_attach(Export *export, const char *name)
+{
+    struct stat info;
+    int         fd = shm_open(name, O_RDONLY, 0);
+
+    export->shared = NULL;
+    export->owner = false;
+    export_set_name(export, name);
+
+    if (fd < 0)
+    {
+        printf("could not open shared memory %s!\n", name);
+        return false;
+    }
+
+    if (fstat(fd, &info) < 0 || info.st_size < EXPORT_ALIGN)
+    {
+        printf("shared memory %s is too small!\n", name);
+        close(fd);
+        return false;
+    }
+
+    export->size = info.st_size;
+    export->shared = mmap(NULL, export->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (export->shared == MAP_FAILED)
+    {
+        printf("could not map shared memory %s!\n", name);
+        export->shared = NULL;
+        return false;
+    }
+
+    const ExportHeader *header = export->shared;
+
+    if (header->magic != EXPORT_MAGIC || header->version != EXPORT_VERSION
+    || header->slot_size < sizeof(ExportSlot)
+    || EXPORT_ALIGN + (size_t)header->slot_count * header->slot_size > export->size)
+    {
+        printf("%s is not a frame export!\n", name);
+        export_close(export);
+        return false;
+    }
+
+    return true;
+}
+
+void export_close(Export *export)
+{
+    if (export->shared)
+        munmap(export->shared, export->size);
+
+    // readers keep their mapping after the name is gone
+    if (export->owner)
+        shm_unlink(export->name);
+
+    export->shared = NULL;
+}
+
+const ExportSlot *export_slot(const Export *export, uint64_t index)
+{
+    const ExportHeader *header = export->shared;
+
+    return (const ExportSlot *)((const uint8_t *)header + EXPORT_ALIGN
+        + (index % header->slot_count) * header->slot_size);
+}
+
+void export_publish(Export *export, NesMachine *nes)
+{
+    ExportHeader    *header = export->shared;
+    uint64_t        index = atomic_load_explicit(&header->written, memory_order_relaxed),
+                    now = export_now();
+
+    ExportSlot      *slot = (ExportSlot *)export_slot(export, index);
+    uint64_t        sequence = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->frame = nes_frame_count(nes);
+    slot->hash = nes_state_hash(nes);
+    slot->timestamp = now;
+    slot->frame_time = export->last_publish ? now - export->last_publish : 0;
+
+    memcpy(slot->ram, nes_cpu(nes)->bus.cpu_vram, sizeof(slot->ram));
+    memcpy(slot->pixels, nes_frame(nes)->data, sizeof(slot->pixels));
+
+    atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+    atomic_store_explicit(&header->written, index + 1, memory_order_release);
+
+    export->last_publish = now;
+}
+
+uint64_t export_read_begin(const ExportSlot *slot)
+{
+    return atomic_load_explicit((_Atomic uint64_t *)&slot->sequence, memory_order_acquire);
+}
+
+bool export_read_valid(const ExportSlot *slot, uint64_t sequence)
+{
+    atomic_thread_fence(memory_order_acquire);
+
+    return !(sequence & 1)
+        && atomic_load_explicit((_Atomic uint64_t *)&slot->sequence, memory_order_relaxed) == sequence;
+}
@@ -0,0 +1,59 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdatomic.h>
+#include "nes.h"
+
+#define EXPORT_MAGIC        0x5845534Eu     // "NESX"
+#define EXPORT_VERSION      1
+
+// one published frame, rewritten in place once the ring comes around
+typedef struct ExportSlot
+{
+    // odd while the writer is inside, a reader's copy is good if it saw
+    // the same even value before and after
+    _Atomic uint64_t    sequence;
+
+    uint64_t            frame, hash;
+
+    // monotonic ns at publish and since the publish before it
+    uint64_t            timestamp, frame_time;
+
+    uint8_t             ram[2048];
+    uint32_t            pixels[FRAME_LENGTH];
+} ExportSlot;
+
+// start of the shared memory object, the slots follow it
+typedef struct ExportHeader
+{
+    uint32_t            magic, version, slot_count, slot_size;
+
+    // frames published so far, the newest is in slot (written - 1) % slot_count
+    _Atomic uint64_t    written;
+} ExportHeader;
+
+typedef struct Export
+{
+    ExportHeader    *shared;
+    size_t          size;
+    char            name[64];
+    bool            owner;
+
+    uint64_t        last_publish;
+} Export;
+
+// writer side, creates or replaces the shm object called name ("/nes")
+bool export_create(Export *export, const char *name, unsigned int slot_count);
+// never waits on readers, a reader that falls a ring behind misses frames
+void export_publish(Export *export, NesMachine *nes);
+
+// reader side, maps an existing object read only
+bool export_attach(Export *export, const char *name);
+void export_close(Export *export);
+
+// slot the index-th published frame went to, index < written
+const ExportSlot *export_slot(const Export *export, uint64_t index);
+uint64_t export_read_begin(const ExportSlot *slot);
+bool export_read_valid(const ExportSlot *slot, uint64_t sequence);
+
+#endif
@@ -0,0 +1,101 @@
+#include <time.h>
+#include "export.h"
+#include "hash.h"
+
+static void usage()
+{
+    printf("usage: nes_export_reader <name> [-n frames] [-q]\n");
+    printf("  follows a frame export from nes_headless -e, -q only prints the totals\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char      *name = NULL;
+    unsigned int    target = 0;
+    bool            quiet = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            target = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-q"))
+            quiet = true;
+        else if (!name)
+            name = argv[i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!name)
+    {
+        usage();
+        return 1;
+    }
+
+    Export export;
+
+    if (!export_attach(&export, name))
+        return 1;
+
+    const ExportHeader  *header = export.shared;
+    uint64_t            next = atomic_load_explicit((_Atomic uint64_t *)&header->written, memory_order_acquire),
+                        read = 0,
+                        dropped = 0;
+
+    unsigned int        idle = 0;
+
+    struct timespec     pause = { 0, 1000000 };
+
+    // gives up once the writer has been quiet for two seconds
+    while ((!target || read < target) && idle < 2000)
+    {
+        uint64_t written = atomic_load_explicit((_Atomic uint64_t *)&header->written, memory_order_acquire);
+
+        if (next == written)
+        {
+            idle++;
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        idle = 0;
+
+        // whatever the ring has already come around on is gone
+        if (written - next > header->slot_count)
+        {
+            dropped += written - next - header->slot_count;
+            next = written - header->slot_count;
+        }
+
+        for (; next < written && (!target || read < target); next++)
+        {
+            const ExportSlot    *slot = export_slot(&export, next);
+            uint64_t            sequence = export_read_begin(slot),
+                                frame = slot->frame,
+                                hash = slot->hash,
+                                frame_time = slot->frame_time,
+                                pixels = hash_xxh64(slot->pixels, sizeof(slot->pixels), 0);
+
+            if (!export_read_valid(slot, sequence))
+            {
+                dropped++;
+                continue;
+            }
+
+            read++;
+
+            if (!quiet)
+                printf("frame %llu hash %016llx pixels %016llx %.3f ms\n", (unsigned long long)frame,
+                    (unsigned long long)hash, (unsigned long long)pixels, frame_time / 1e6);
+        }
+    }
+
+    printf("%llu frames read, %llu dropped\n", (unsigned long long)read, (unsigned long long)dropped);
+
+    export_close(&export);
+
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint64_t hash_xxh64(const void *data, size_t length, uint64_t seed);
+
+#endif
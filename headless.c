@@ -0,0 +1,150 @@
+#include <time.h>
+#include "export.h"
+#include "movie.h"
+
+static void usage()
+{
+    printf("usage: nes_headless <rom.nes> [-n frames] [-s frameskip] [-o last_frame.ppm] [-H] [-m movie] [-e /shm_name]\n");
+    printf("  -s N draws one frame out of every N, by default only the last one for -o\n");
+    printf("  -H prints the state hash after every frame\n");
+    printf("  -m plays back a movie for its length and checks the final state\n");
+    printf("  -e draws every frame and publishes it with the ram to shared memory\n");
+}
+
+static bool write_ppm(const Frame *frame, const char *filename)
+{
+    FILE *f = fopen(filename, "wb");
+
+    if (!f)
+    {
+        printf("Could not open %s for writing!\n", filename);
+        return false;
+    }
+
+    fprintf(f, "P6\n%d %d\n255\n", FRAME_WIDTH, FRAME_HEIGHT);
+
+    for (int i = 0; i < FRAME_LENGTH; i++)
+    {
+        uint32_t pixel = frame->data[i];
+
+        fputc(pixel & 0xFF, f);
+        fputc((pixel >> 8) & 0xFF, f);
+        fputc((pixel >> 16) & 0xFF, f);
+    }
+
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char      *rom_file = NULL, 
+                    *out_file = NULL,
+                    *movie_file = NULL,
+                    *export_name = NULL;
+
+    unsigned int    target = 60,
+                    skip = 0;
+
+    bool            print_hashes = false,
+                    target_set = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+        {
+            target = strtoul(argv[++i], NULL, 10);
+            target_set = true;
+        }
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            skip = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            out_file = argv[++i];
+        else if (!strcmp(argv[i], "-H"))
+            print_hashes = true;
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+            movie_file = argv[++i];
+        else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+            export_name = argv[++i];
+        else if (!rom_file)
+            rom_file = argv[i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!rom_file)
+    {
+        usage();
+        return 1;
+    }
+
+    NesMachine  *nes = nes_create();
+    FrameSkip   frameskip;
+    Movie       movie;
+    Export      export = { 0 };
+
+    movie_init(&movie);
+
+    if (!nes_load_file(nes, rom_file)
+    || (movie_file && (!movie_load(&movie, movie_file) || !movie_start(&movie, nes)))
+    || (export_name && !export_create(&export, export_name, 8)))
+    {
+        movie_free(&movie);
+        nes_destroy(nes);
+        return 1;
+    }
+
+    if (movie_file && !target_set)
+        target = movie.frames;
+
+    frameskip_init(&frameskip, skip);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the last frame is drawn when there is somewhere to write it out
+    for (unsigned int n = 1; n <= target; n++)
+    {
+        if (movie_file)
+            movie_input(&movie, n - 1, nes);
+
+        nes_step(nes, frameskip_next(&frameskip) || (out_file && n == target) || export_name);
+
+        if (export_name)
+            export_publish(&export, nes);
+
+        if (print_hashes)
+            printf("%u %016llx\n", n, (unsigned long long)nes_state_hash(nes));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%u frames in %.3f s, %.1f fps\n", target, seconds, target / seconds);
+
+    if (out_file)
+        write_ppm(nes_frame(nes), out_file);
+
+    bool synced = true;
+
+    // a shorter or longer run than the recording ends somewhere else
+    if (movie_file && target == movie.frames)
+    {
+        synced = movie_verify(&movie, nes);
+
+        if (synced)
+            printf("movie in sync, final state hash %016llx\n", (unsigned long long)movie.final_hash);
+    }
+
+    if (export_name)
+        export_close(&export);
+
+    movie_free(&movie);
+    nes_destroy(nes);
+
+    return synced ? 0 : 1;
+}
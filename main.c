@@ -1,15 +1,31 @@
 #include <GL/glew.h>
 #include <GL/glut.h>
 #include "audio.h"
-#include "emu.h"
+#include "movie.h"
+#include "pipeline.h"
 
-Frame frame;
-CPU cpu;
+typedef struct Frontend
+{
+    NesMachine      *nes;
+    RenderPipeline  pipeline;
+    FrameSkip       frameskip;
+    NesPalette      palette;
+
+    // frames shown ahead of the emulated one, drawn on this thread when set
+    unsigned int    run_ahead;
+
+    unsigned int    texture;
+
+    // input is recorded here when a movie file is given, saved on exit
+    Movie           movie;
+    const char      *movie_file;
 
-unsigned int texture;
+    bool            key_states[256];   //key_special_states[256]
+    bool            quit;
+} Frontend;
 
-bool key_states[256];   //key_special_states[256]
-bool quit;
+// glut callbacks take no user data, so this is the one thing they can reach
+static Frontend *frontend;
 
 static void close_window()
 {
@@ -19,8 +35,20 @@ static void close_window()
     if (err != paNoError)
         printf("PortAudio error: %s\n", Pa_GetErrorText(err));
     */
-    rom_reset(&cpu.bus.rom);
-    glDeleteTextures(1, &texture);
+    if (frontend->nes)
+    {
+        if (frontend->movie_file)
+        {
+            movie_end(&frontend->movie, frontend->nes);
+            movie_save(&frontend->movie, frontend->movie_file);
+        }
+
+        pipeline_stop(&frontend->pipeline, &nes_cpu(frontend->nes)->bus.ppu);
+        nes_destroy(frontend->nes);
+        frontend->nes = NULL;
+    }
+
+    glDeleteTextures(1, &frontend->texture);
 
     glutDestroyWindow(glutGetWindow());
 
@@ -29,12 +57,12 @@ static void close_window()
 
 static void key_down(unsigned char key, int x, int y)
 {
-    key_states[key] = true;
+    frontend->key_states[key] = true;
 }
 
 static void key_up(unsigned char key, int x, int y)
 {
-    key_states[key] = false;
+    frontend->key_states[key] = false;
 }
 
 static void key_special_down(unsigned char key, int x, int y)
@@ -49,42 +77,40 @@ static void key_special_up(unsigned char key, int x, int y)
 
 static void key_handler()
 {
+    bool            *key_states = frontend->key_states;
+    unsigned char   buttons = 0;
+
     if (key_states[0x1B])    
     {
-        quit = true;
+        frontend->quit = true;
         return;
     }
 
-    if (key_states['.'])    cpu.bus.joypad1.button_status |= A;
-    else                    cpu.bus.joypad1.button_status &= 0b11111110;
-
-    if (key_states[','])    cpu.bus.joypad1.button_status |= B;
-    else                    cpu.bus.joypad1.button_status &= 0b11111101;
-
-    if (key_states[8])      cpu.bus.joypad1.button_status |= SELECT;
-    else                    cpu.bus.joypad1.button_status &= 0b11111011;
-
-    if (key_states[13])     cpu.bus.joypad1.button_status |= START;
-    else                    cpu.bus.joypad1.button_status &= 0b11110111;
-
-    if (key_states['w'])    cpu.bus.joypad1.button_status |= UP;
-    else                    cpu.bus.joypad1.button_status &= 0b11101111;
-
-    if (key_states['s'])    cpu.bus.joypad1.button_status |= DOWN;
-    else                    cpu.bus.joypad1.button_status &= 0b11011111;
+    if (key_states['.'])    buttons |= A;
+    if (key_states[','])    buttons |= B;
+    if (key_states[8])      buttons |= SELECT;
+    if (key_states[13])     buttons |= START;
+    if (key_states['w'])    buttons |= UP;
+    if (key_states['s'])    buttons |= DOWN;
+    if (key_states['a'])    buttons |= LEFT;
+    if (key_states['d'])    buttons |= RIGHT;
 
-    if (key_states['a'])    cpu.bus.joypad1.button_status |= LEFT;
-    else                    cpu.bus.joypad1.button_status &= 0b10111111;
-
-    if (key_states['d'])    cpu.bus.joypad1.button_status |= RIGHT;
-    else                    cpu.bus.joypad1.button_status &= 0b01111111;
+    nes_set_buttons(frontend->nes, buttons, 0);
 }
 
+// the display callback, the emulation loop only asks glut to call it
 static void render()
 {
-    glBindTexture(GL_TEXTURE_2D, texture);
+    // newest frame the render thread has finished, none before the first
+    const Frame *latest = NULL;
+
+    if (frontend->nes)
+        latest = frontend->run_ahead ? nes_frame(frontend->nes) : pipeline_frame(&frontend->pipeline);
 
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 240, GL_RGB, GL_UNSIGNED_BYTE, frame.data);
+    glBindTexture(GL_TEXTURE_2D, frontend->texture);
+
+    if (latest)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 240, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, latest->data);
 
     glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -114,77 +140,77 @@ static void render()
 
 static void emu_loop()
 {
-    if (quit) 
+    if (frontend->quit) 
     {
         close_window();
         return;
     }
-    
-    cpu_interpret(&cpu);
-}
 
-void cpu_callback(Bus *bus)
-{
-    if (bus->ppu.mask & BACKGROUND_SHOW 
-    && bus->ppu.mask & SPRITES_SHOW)
-    {
-        ppu_render(&bus->ppu, &frame);
-        render();
-    }
-    
-    key_handler();
-}
+    if (!frontend->nes)
+        return;
 
-static void emu_init(CPU *cpu, Frame *frame)
-{
-    FILE *f;
+    if (frontend->run_ahead)
+    {
+        // input goes in before the real frame so the hidden ones see it too
+        key_handler();
 
-    f = fopen("super.nes", "r");
+        if (frontend->movie_file)
+            movie_record(&frontend->movie, frontend->nes);
 
-    if (!f)
-    {
-        printf("Could not open file!\n");
+        nes_step_ahead(frontend->nes, frontend->run_ahead);
+        render();
         return;
     }
 
-    fseek(f, 0L, SEEK_END);
-    long size = ftell(f);
+    if (frontend->movie_file)
+        movie_record(&frontend->movie, frontend->nes);
 
-    printf("file size:%ld\n", size);
+    nes_step(frontend->nes, false);
 
-    unsigned char *file_buffer = malloc(size);
-    int i = 0;
+    PPU     *ppu = &nes_cpu(frontend->nes)->bus.ppu;
+    bool    show = frameskip_next(&frontend->frameskip)
+                    && ppu->mask & BACKGROUND_SHOW 
+                    && ppu->mask & SPRITES_SHOW;
 
-    rewind(f);
+    // the render thread draws this frame while the next one is emulated
+    pipeline_submit(&frontend->pipeline, ppu, show);
 
-    while (!feof(f))
-    {
-        file_buffer[i] = fgetc(f);
-        i++;
-    }
+    // and it is presented whenever one has been finished, never waited for
+    if (pipeline_frame_ready(&frontend->pipeline))
+        glutPostRedisplay();
 
-    fclose(f);
+    key_handler();
+}
 
-    rom_init(&cpu->bus.rom);
+static void emu_init(const char *palette_file)
+{
+    NesMachine *nes = nes_create();
 
-    if (!rom_load(&cpu->bus.rom, file_buffer))
+    if (!nes_load_file(nes, "super.nes"))
     {
-        printf("could not load rom!\n");
-        free(file_buffer);
+        nes_destroy(nes);
         return;
     }
 
-    free(file_buffer);
+    if (palette_file && palette_load(&frontend->palette, palette_file))
+        nes_set_palette(nes, &frontend->palette);
 
-    cpu_init(cpu);
-    joypad_init(&cpu->bus.joypad1);
-    ppu_load(&cpu->bus.ppu, cpu->bus.rom.chr_rom, cpu->bus.rom.screen_mirroring);
-    addr_reset(&cpu->bus.ppu.addr);
+    if (frontend->movie_file && !movie_begin(&frontend->movie, nes, false))
+    {
+        nes_destroy(nes);
+        return;
+    }
 
-    frame_init(frame);
+    // running ahead rewinds the machine every frame, which the render
+    // thread's write log can not follow
+    if (!frontend->run_ahead 
+    && !pipeline_start(&frontend->pipeline, &nes_cpu(nes)->bus.ppu))
+    {
+        nes_destroy(nes);
+        return;
+    }
 
-    // test this
-    cpu->bus.ppu.frame = frame;
+    frontend->nes = nes;
 }
 
 void reshape(int width, int height)
@@ -194,7 +220,21 @@ void reshape(int width, int height)
 
 int main(int argc, char *argv[])
 {
+    frontend = calloc(1, sizeof(Frontend));
+
     glutInit(&argc, (char**)argv);
+
+    // optional .pal file, frameskip, run-ahead and a movie to record to,
+    // glutInit has already taken its own arguments. Nothing here asks for
+    // frames on demand, so a frameskip of 0 is not allowed
+    int interval = argc > 2 ? atoi(argv[2]) : 1;
+
+    if (interval < 1 || interval > 255)
+    {
+        fprintf(stderr, "frameskip must be between 1 and 255\n");
+        return 1;
+    }
+
     glutInitDisplayMode(GLUT_SINGLE);
     glutInitWindowSize(256, 240);
     glutInitWindowPosition(832, 420);
@@ -202,9 +242,9 @@ int main(int argc, char *argv[])
 
     // setup texture
     glEnable(GL_TEXTURE_2D);
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 256, 240, 0, GL_RGB, GL_UNSIGNED_BYTE, frame.data);
+    glGenTextures(1, &frontend->texture);
+    glBindTexture(GL_TEXTURE_2D, frontend->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 240, 0, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
     glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -226,11 +266,10 @@ int main(int argc, char *argv[])
         goto quit;
     }
     */
-    memset(key_states, false, 256);
-
-    emu_init(&cpu, &frame);
-
-    quit = false;
+    frameskip_init(&frontend->frameskip, interval);
+    frontend->run_ahead = argc > 3 ? atoi(argv[3]) : 0;
+    frontend->movie_file = argc > 4 ? argv[4] : NULL;
+    emu_init(argc > 1 ? argv[1] : NULL);
 
     glutMainLoop();
 
@@ -241,8 +280,15 @@ int main(int argc, char *argv[])
     if (err != paNoError)
         printf("PortAudio error: %s\n", Pa_GetErrorText(err));
     */
-    rom_reset(&cpu.bus.rom);
-    glDeleteTextures(1, &texture);
+    if (frontend->nes)
+    {
+        pipeline_stop(&frontend->pipeline, &nes_cpu(frontend->nes)->bus.ppu);
+        nes_destroy(frontend->nes);
+    }
+
+    glDeleteTextures(1, &frontend->texture);
+    movie_free(&frontend->movie);
+    free(frontend);
 
     printf("clean exit\n");
     return 0;
@@ -0,0 +1,301 @@
+#include "mapper.h"
+
+// the 1 KB chr windows from window on show count banks in a row from bank
+static void mapper_set_chr_banks(Bus *bus, uint8_t window, unsigned int bank, uint8_t count)
+{
+    for (int i = 0; i < count; i++)
+        ppu_set_chr_bank(&bus->ppu, window + i, bank + i);
+}
+
+// redrawing the background on every write would be wasted on games that
+// set the same mirroring each frame
+static void mapper_set_mirroring(Bus *bus, enum Mirroring mirroring)
+{
+    if (bus->ppu.mirroring != mirroring)
+        ppu_set_mirroring(&bus->ppu, mirroring);
+}
+
+static unsigned int mapper_prg_bank_count(Bus *bus)
+{
+    return bus->rom.prg_len >> 13;
+}
+
+void mapper_set_prg_bank(Bus *bus, uint8_t window, unsigned int bank)
+{
+    bus->prg_banks[window] = &bus->rom.prg_rom[(bank % mapper_prg_bank_count(bus)) << 13];
+}
+
+// NROM, 16 KB carts show up twice
+static void nrom_apply(Bus *bus)
+{
+    for (int window = 0; window < 4; window++)
+        mapper_set_prg_bank(bus, window, window);
+
+    mapper_set_chr_banks(bus, 0, 0, 8);
+}
+
+static void nrom_write(Bus *bus, unsigned short addr, unsigned char data)
+{
+    // rom ignores writes
+}
+
+// MMC1, registers are written one bit at a time through a serial port
+static const enum Mirroring MMC1_MIRRORING[4] = {
+    SINGLE_SCREEN_LOWER, SINGLE_SCREEN_UPPER, VERTICAL, HORIZONTAL
+};
+
+static void mmc1_reset(Mapper *mapper)
+{
+    // the last bank is fixed at $C000 so the reset vector is there
+    mapper->control = 0x0C;
+}
+
+static void mmc1_apply(Bus *bus)
+{
+    Mapper          *mapper = &bus->mapper;
+    unsigned char   prg = mapper->registers[2] & 0x0F,
+                    chr_0 = mapper->registers[0],
+                    chr_1 = mapper->registers[1];
+
+    // 512 KB carts pick their 256 KB half with bit 4 of chr 0, the banks
+    // below are in 16 KB units
+    unsigned int    outer = bus->rom.prg_len > 0x40000 ? chr_0 & 0x10 : 0;
+
+    switch ((mapper->control >> 2) & 0b11)
+    {
+        case 0:
+        case 1:
+            // 32 KB at once, the low bit is ignored
+            for (int window = 0; window < 4; window++)
+                mapper_set_prg_bank(bus, window, ((outer | (prg & ~1)) << 1) + window);
+            break;
+        case 2:
+            mapper_set_prg_bank(bus, 0, outer << 1);
+            mapper_set_prg_bank(bus, 1, (outer << 1) + 1);
+            mapper_set_prg_bank(bus, 2, (outer | prg) << 1);
+            mapper_set_prg_bank(bus, 3, ((outer | prg) << 1) + 1);
+            break;
+        case 3:
+            mapper_set_prg_bank(bus, 0, (outer | prg) << 1);
+            mapper_set_prg_bank(bus, 1, ((outer | prg) << 1) + 1);
+            mapper_set_prg_bank(bus, 2, (outer | 0x0F) << 1);
+            mapper_set_prg_bank(bus, 3, ((outer | 0x0F) << 1) + 1);
+            break;
+    }
+
+    // two 4 KB banks or one 8 KB bank without its low bit
+    if (mapper->control & 0x10)
+    {
+        mapper_set_chr_banks(bus, 0, chr_0 << 2, 4);
+        mapper_set_chr_banks(bus, 4, chr_1 << 2, 4);
+    }
+    else
+        mapper_set_chr_banks(bus, 0, (chr_0 & ~1) << 2, 8);
+}
+
+static void mmc1_write(Bus *bus, unsigned short addr, unsigned char data)
+{
+    Mapper *mapper = &bus->mapper;
+
+    // bit 7 empties the shift register and fixes the last bank again
+    if (data & 0x80)
+    {
+        mapper->shift = 0;
+        mapper->shift_count = 0;
+        mapper->control |= 0x0C;
+        mmc1_apply(bus);
+        return;
+    }
+
+    mapper->shift |= (data & 1) << mapper->shift_count;
+
+    if (++mapper->shift_count < 5)
+        return;
+
+    // the fifth write picks the register with bits 13 and 14 of its address
+    unsigned char reg = (addr >> 13) & 0b11;
+
+    if (reg == 0)
+    {
+        mapper->control = mapper->shift;
+        mapper_set_mirroring(bus, MMC1_MIRRORING[mapper->control & 0b11]);
+    }
+    else
+        mapper->registers[reg - 1] = mapper->shift;
+
+    mapper->shift = 0;
+    mapper->shift_count = 0;
+
+    mmc1_apply(bus);
+}
+
+// UxROM, 16 KB at $8000 switches and the last 16 KB stays at $C000
+static void uxrom_apply(Bus *bus)
+{
+    unsigned int last = mapper_prg_bank_count(bus) - 2;
+
+    mapper_set_prg_bank(bus, 0, bus->mapper.registers[0] << 1);
+    mapper_set_prg_bank(bus, 1, (bus->mapper.registers[0] << 1) + 1);
+    mapper_set_prg_bank(bus, 2, last);
+    mapper_set_prg_bank(bus, 3, last + 1);
+
+    mapper_set_chr_banks(bus, 0, 0, 8);
+}
+
+static void uxrom_write(Bus *bus, unsigned short addr, unsigned char data)
+{
+    bus->mapper.registers[0] = data;
+    uxrom_apply(bus);
+}
+
+// CNROM, fixed prg and one 8 KB chr bank
+static void cnrom_apply(Bus *bus)
+{
+    for (int window = 0; window < 4; window++)
+        mapper_set_prg_bank(bus, window, window);
+
+    mapper_set_chr_banks(bus, 0, bus->mapper.registers[0] << 3, 8);
+}
+
+static void cnrom_write(Bus *bus, unsigned short addr, unsigned char data)
+{
+    bus->mapper.registers[0] = data;
+    cnrom_apply(bus);
+}
+
+// MMC3, 8 KB prg and 1 KB/2 KB chr banks and an irq after a number of lines
+static void mmc3_reset(Mapper *mapper)
+{
+    static const unsigned char registers[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+
+    memcpy(mapper->registers, registers, sizeof(registers));
+}
+
+static void mmc3_apply(Bus *bus)
+{
+    Mapper          *mapper = &bus->mapper;
+    unsigned char   *r = mapper->registers,
+                    invert = mapper->select & 0x80 ? 4 : 0;
+
+    unsigned int    second_last = mapper_prg_bank_count(bus) - 2;
+
+    // bit 6 swaps which of $8000 and $C000 is fixed to the second last bank
+    mapper_set_prg_bank(bus, mapper->select & 0x40 ? 2 : 0, r[6] & 0x3F);
+    mapper_set_prg_bank(bus, mapper->select & 0x40 ? 0 : 2, second_last);
+    mapper_set_prg_bank(bus, 1, r[7] & 0x3F);
+    mapper_set_prg_bank(bus, 3, second_last + 1);
+
+    // R0 and R1 are 2 KB banks, bit 7 swaps the pattern table halves
+    mapper_set_chr_banks(bus, 0 ^ invert, r[0] & ~1, 2);
+    mapper_set_chr_banks(bus, 2 ^ invert, r[1] & ~1, 2);
+
+    for (int i = 0; i < 4; i++)
+        ppu_set_chr_bank(&bus->ppu, (4 + i) ^ invert, r[2 + i]);
+}
+
+static void mmc3_write(Bus *bus, unsigned short addr, unsigned char data)
+{
+    Mapper *mapper = &bus->mapper;
+
+    // even and odd addresses of each 8 KB range are two registers
+    switch (addr & 0xE001)
+    {
+        case 0x8000:
+            mapper->select = data;
+            mmc3_apply(bus);
+            break;
+        case 0x8001:
+            mapper->registers[mapper->select & 0b111] = data;
+            mmc3_apply(bus);
+            break;
+        case 0xA000:
+            if (bus->rom.screen_mirroring != FOUR_SCREEN)
+                mapper_set_mirroring(bus, data & 1 ? HORIZONTAL : VERTICAL);
+            break;
+        case 0xA001:
+            // prg ram protect, the ram is left writable
+            break;
+        case 0xC000:
+            mapper->irq_latch = data;
+            break;
+        case 0xC001:
+            mapper->irq_counter = 0;
+            mapper->irq_reload = 1;
+            break;
+        case 0xE000:
+            mapper->irq_enabled = 0;
+            mapper->irq_pending = 0;
+            break;
+        case 0xE001:
+            mapper->irq_enabled = 1;
+            break;
+    }
+}
+
+static void mmc3_scanline(Bus *bus)
+{
+    Mapper *mapper = &bus->mapper;
+
+    if (!mapper->irq_counter || mapper->irq_reload)
+    {
+        mapper->irq_counter = mapper->irq_latch;
+        mapper->irq_reload = 0;
+    }
+    else
+        mapper->irq_counter--;
+
+    if (!mapper->irq_counter && mapper->irq_enabled)
+        mapper->irq_pending = 1;
+}
+
+static const MapperType MAPPERS[] = {
+    { 0, "NROM",    NULL,       nrom_apply,     nrom_write,     NULL },
+    { 1, "MMC1",    mmc1_reset, mmc1_apply,     mmc1_write,     NULL },
+    { 2, "UxROM",   NULL,       uxrom_apply,    uxrom_write,    NULL },
+    { 3, "CNROM",   NULL,       cnrom_apply,    cnrom_write,    NULL },
+    { 4, "MMC3",    mmc3_reset, mmc3_apply,     mmc3_write,     mmc3_scanline },
+};
+
+const MapperType *mapper_find(unsigned char number)
+{
+    for (int i = 0; i < sizeof(MAPPERS) / sizeof(MAPPERS[0]); i++)
+    {
+        if (MAPPERS[i].number == number)
+            return &MAPPERS[i];
+    }
+
+    return NULL;
+}
+
+void mapper_reset(Bus *bus)
+{
+    bus->mapper_type = mapper_find(bus->rom.mapper);
+
+    memset(&bus->mapper, 0, sizeof(bus->mapper));
+
+    if (bus->mapper_type->reset)
+        bus->mapper_type->reset(&bus->mapper);
+
+    bus->mapper_type->apply(bus);
+}
+
+void mapper_apply(Bus *bus)
+{
+    bus->mapper_type->apply(bus);
+}
+
+void mapper_write(Bus *bus, unsigned short addr, unsigned char data)
+{
+    bus->mapper_type->write(bus, addr, data);
+}
+
+void mapper_clock_lines(Bus *bus)
+{
+    if (bus->mapper_type->scanline)
+    {
+        for (int i = 0; i < bus->ppu.line_clocks; i++)
+            bus->mapper_type->scanline(bus);
+    }
+
+    bus->ppu.line_clocks = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include "emu.h"
+
+// the bank switching hardware of one kind of cart, banks are only ever
+// switched by pointing the bus and PPU windows somewhere else in the rom
+struct MapperType
+{
+    unsigned char   number;
+    const char      *name;
+
+    // power-on registers
+    void            (*reset)(Mapper *mapper);
+    // points every prg and chr window at what the registers select
+    void            (*apply)(Bus *bus);
+    // $8000-$FFFF
+    void            (*write)(Bus *bus, uint16_t addr, uint8_t data);
+    // once for every rendered line, NULL if the mapper does not count them
+    void            (*scanline)(Bus *bus);
+};
+
+// NULL for mappers that are not supported
+const MapperType *mapper_find(uint8_t number);
+
+void mapper_reset(Bus *bus);
+void mapper_apply(Bus *bus);
+void mapper_write(Bus *bus, uint16_t addr, uint8_t data);
+void mapper_clock_lines(Bus *bus);
+
+// window and bank in 8 KB units, banks past the end of the rom wrap around
+void mapper_set_prg_bank(Bus *bus, uint8_t window, unsigned int bank);
+
+#endif
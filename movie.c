@@ -0,0 +1,299 @@
+#include "movie.h"
+#include "state.h"
+
+// a movie file is "NESM", a version byte, the rom hash, the final state hash,
+// the frame count, the start state (length 0 for power on) and then runs of
+// identical input, a 16-bit frame count followed by the two joypad bytes
+
+static void movie_put16(FILE *f, uint16_t value)
+{
+    fputc(value & 0xFF, f);
+    fputc(value >> 8, f);
+}
+
+static void movie_put32(FILE *f, uint32_t value)
+{
+    movie_put16(f, value & 0xFFFF);
+    movie_put16(f, value >> 16);
+}
+
+static void movie_put64(FILE *f, uint64_t value)
+{
+    movie_put32(f, value & 0xFFFFFFFF);
+    movie_put32(f, value >> 32);
+}
+
+static bool movie_get(FILE *f, uint64_t *value, int bytes)
+{
+    uint8_t data[8];
+
+    if (fread(data, 1, bytes, f) != bytes)
+        return false;
+
+    *value = 0;
+
+    for (int i = 0; i < bytes; i++)
+        *value |= (uint64_t)data[i] << (i << 3);
+
+    return true;
+}
+
+void movie_init(Movie *movie)
+{
+    movie->rom_hash = 0;
+    movie->final_hash = 0;
+    movie->start_state = NULL;
+    movie->start_length = 0;
+    movie->input = NULL;
+    movie->frames = 0;
+    movie->capacity = 0;
+}
+
+void movie_free(Movie *movie)
+{
+    free(movie->start_state);
+    free(movie->input);
+
+    movie_init(movie);
+}
+
+static bool movie_reserve(Movie *movie, unsigned int frames)
+{
+    if (frames <= movie->capacity)
+        return true;
+
+    if (frames > MOVIE_MAX_FRAMES)
+    {
+        printf("movie is longer than %u frames!\n", MOVIE_MAX_FRAMES);
+        return false;
+    }
+
+    size_t      capacity = movie->capacity ? movie->capacity : 3600;
+    uint8_t     *input;
+
+    while (capacity < frames)
+        capacity <<= 1;
+
+    if (capacity > MOVIE_MAX_FRAMES)
+        capacity = MOVIE_MAX_FRAMES;
+
+    // two joypad bytes a frame
+    if (capacity > SIZE_MAX / 2)
+        return false;
+
+    input = realloc(movie->input, capacity * 2);
+
+    if (!input)
+    {
+        printf("could not allocate movie input!\n");
+        return false;
+    }
+
+    movie->input = input;
+    movie->capacity = capacity;
+
+    return true;
+}
+
+bool movie_begin(Movie *movie, NesMachine *nes, bool from_state)
+{
+    movie_free(movie);
+    movie->rom_hash = nes_rom_hash(nes);
+
+    if (!from_state)
+    {
+        nes_power_cycle(nes);
+        return true;
+    }
+
+    movie->start_state = malloc(STATE_MAX_SIZE);
+
+    if (!movie->start_state)
+    {
+        printf("could not allocate movie start state!\n");
+        return false;
+    }
+
+    movie->start_length = nes_save_state(nes, movie->start_state, STATE_MAX_SIZE);
+
+    return movie->start_length > 0;
+}
+
+bool movie_record(Movie *movie, NesMachine *nes)
+{
+    const Bus *bus = &nes_cpu(nes)->bus;
+
+    if (!movie_reserve(movie, movie->frames + 1))
+        return false;
+
+    movie->input[movie->frames * 2] = bus->joypad1.button_status;
+    movie->input[movie->frames * 2 + 1] = bus->joypad2.button_status;
+    movie->frames++;
+
+    return true;
+}
+
+void movie_end(Movie *movie, const NesMachine *nes)
+{
+    movie->final_hash = nes_state_hash(nes);
+}
+
+bool movie_save(const Movie *movie, const char *filename)
+{
+    FILE *f = fopen(filename, "wb");
+
+    if (!f)
+    {
+        printf("Could not open %s for writing!\n", filename);
+        return false;
+    }
+
+    fwrite("NESM", 1, 4, f);
+    fputc(MOVIE_VERSION, f);
+    movie_put64(f, movie->rom_hash);
+    movie_put64(f, movie->final_hash);
+    movie_put32(f, movie->frames);
+    movie_put32(f, movie->start_length);
+    fwrite(movie->start_state, 1, movie->start_length, f);
+
+    for (unsigned int frame = 0; frame < movie->frames;)
+    {
+        const uint8_t   *input = &movie->input[frame * 2];
+        unsigned int    run = 1;
+
+        while (frame + run < movie->frames && run < 0xFFFF
+        && !memcmp(&movie->input[(frame + run) * 2], input, 2))
+            run++;
+
+        movie_put16(f, run);
+        fputc(input[0], f);
+        fputc(input[1], f);
+
+        frame += run;
+    }
+
+    bool ok = !ferror(f);
+
+    if (fclose(f) || !ok)
+    {
+        printf("Could not write %s!\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+bool movie_load(Movie *movie, const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+
+    if (!f)
+    {
+        printf("Could not open movie %s!\n", filename);
+        return false;
+    }
+
+    char        magic[5];
+    uint64_t    frames, start_length;
+
+    movie_free(movie);
+
+    if (fread(magic, 1, 5, f) != 5 || memcmp(magic, "NESM", 4) != 0)
+    {
+        printf("%s is not a movie!\n", filename);
+        fclose(f);
+        return false;
+    }
+
+    if (magic[4] != MOVIE_VERSION)
+    {
+        printf("movie version %d not supported!\n", magic[4]);
+        fclose(f);
+        return false;
+    }
+
+    if (!movie_get(f, &movie->rom_hash, 8)
+    || !movie_get(f, &movie->final_hash, 8)
+    || !movie_get(f, &frames, 4)
+    || !movie_get(f, &start_length, 4)
+    || frames > MOVIE_MAX_FRAMES
+    || start_length > STATE_MAX_SIZE)
+        goto corrupt;
+
+    if (start_length)
+    {
+        movie->start_state = malloc(start_length);
+        movie->start_length = start_length;
+
+        if (!movie->start_state
+        || fread(movie->start_state, 1, start_length, f) != start_length)
+            goto corrupt;
+    }
+
+    if (!movie_reserve(movie, frames))
+        goto corrupt;
+
+    while (movie->frames < frames)
+    {
+        uint64_t    run;
+        uint8_t     input[2];
+
+        if (!movie_get(f, &run, 2) || !run || run > frames - movie->frames
+        || fread(input, 1, 2, f) != 2)
+            goto corrupt;
+
+        for (; run > 0; run--, movie->frames++)
+            memcpy(&movie->input[movie->frames * 2], input, 2);
+    }
+
+    fclose(f);
+    return true;
+
+corrupt:
+    printf("movie %s is corrupt!\n", filename);
+    movie_free(movie);
+    fclose(f);
+
+    return false;
+}
+
+bool movie_start(const Movie *movie, NesMachine *nes)
+{
+    if (nes_rom_hash(nes) != movie->rom_hash)
+    {
+        printf("movie was recorded with a different rom!\n");
+        return false;
+    }
+
+    if (!movie->start_state)
+    {
+        nes_power_cycle(nes);
+        return true;
+    }
+
+    return nes_load_state(nes, movie->start_state, movie->start_length);
+}
+
+void movie_input(const Movie *movie, unsigned int frame, NesMachine *nes)
+{
+    // past the end the last input holds
+    if (frame >= movie->frames)
+        frame = movie->frames - 1;
+
+    if (movie->frames)
+        nes_set_buttons(nes, movie->input[frame * 2], movie->input[frame * 2 + 1]);
+}
+
+bool movie_verify(const Movie *movie, const NesMachine *nes)
+{
+    uint64_t hash = nes_state_hash(nes);
+
+    if (hash != movie->final_hash)
+    {
+        printf("movie desynced, final state hash %016llx, expected %016llx\n",
+            (unsigned long long)hash, (unsigned long long)movie->final_hash);
+        return false;
+    }
+
+    return true;
+}
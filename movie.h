@@ -0,0 +1,43 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "nes.h"
+
+#define MOVIE_VERSION       1
+
+// a day of play at 60 frames a second, longer files are taken as corrupt
+#define MOVIE_MAX_FRAMES    (60u * 60 * 60 * 24)
+
+// a recording of both joypads for every frame, replayed from the same start
+typedef struct Movie
+{
+    uint64_t        rom_hash,
+                    final_hash;     // state hash after the last frame
+
+    // save state to start from, NULL starts from power on
+    uint8_t         *start_state;
+    size_t          start_length;
+
+    // joypad1 and joypad2 button_status, two bytes per frame
+    uint8_t         *input;
+    unsigned int    frames, capacity;
+} Movie;
+
+void movie_init(Movie *movie);
+void movie_free(Movie *movie);
+
+// from_state keeps the machine as it is instead of resetting it on playback
+bool movie_begin(Movie *movie, NesMachine *nes, bool from_state);
+// call before each nes_step with the buttons it is going to run with
+bool movie_record(Movie *movie, NesMachine *nes);
+void movie_end(Movie *movie, const NesMachine *nes);
+
+bool movie_save(const Movie *movie, const char *filename);
+bool movie_load(Movie *movie, const char *filename);
+
+// puts nes where the recording started, fails on a different rom
+bool movie_start(const Movie *movie, NesMachine *nes);
+void movie_input(const Movie *movie, unsigned int frame, NesMachine *nes);
+bool movie_verify(const Movie *movie, const NesMachine *nes);
+
+#endif
@@ -0,0 +1,240 @@
+#include "nes.h"
+#include "state.h"
+#include "clone.h"
+
+struct NesMachine
+{
+    CPU             cpu;
+    Frame           frame;
+
+    const NesPalette *palette;
+
+    // state to come back to after running ahead
+    uint8_t         ahead_state[STATE_MAX_SIZE];
+
+    // clone the machine was last cloned to or restored from
+    NesClone        *base;
+
+    unsigned int    frame_count;
+    bool            frame_done:1, render:1, loaded:1;
+};
+
+static void nes_frame_callback(Bus *bus, void *data)
+{
+    NesMachine *nes = data;
+
+    if (nes->render)
+        ppu_render(&bus->ppu, &nes->frame);
+
+    nes->frame_count++;
+    nes->frame_done = true;
+}
+
+NesMachine *nes_create()
+{
+    // calloc so nothing a load leaves alone starts out as garbage
+    NesMachine *nes = calloc(1, sizeof(NesMachine));
+
+    if (!nes)
+        return NULL;
+
+    rom_init(&nes->cpu.bus.rom);
+    frame_init(&nes->frame);
+
+    nes->palette = &NES_PALETTE_RGBA;
+    nes->base = NULL;
+    nes->frame_count = 0;
+    nes->frame_done = false;
+    nes->render = false;
+    nes->loaded = false;
+
+    return nes;
+}
+
+void nes_destroy(NesMachine *nes)
+{
+    clone_release(nes->base);
+    rom_reset(&nes->cpu.bus.rom);
+    free(nes);
+}
+
+void nes_reset(NesMachine *nes)
+{
+    CPU *cpu = &nes->cpu;
+
+    // the mapper sets up the PPU's chr banks as the cpu comes out of reset
+    ppu_load(&cpu->bus.ppu, cpu->bus.rom.chr_rom, cpu->bus.rom.chr_ram, cpu->bus.rom.chr_len, cpu->bus.rom.screen_mirroring);
+    cpu_init(cpu);
+    bus_set_callback(&cpu->bus, nes_frame_callback, nes);
+    joypad_init(&cpu->bus.joypad1);
+    joypad_init(&cpu->bus.joypad2);
+
+    cpu->bus.ppu.palette = nes->palette;
+
+    frame_init(&nes->frame);
+    nes->frame_count = 0;
+    nes->frame_done = false;
+}
+
+void nes_power_cycle(NesMachine *nes)
+{
+    // a reset keeps the sound registers and the cart's ram, switching on
+    // starts them from zero
+    memset(&nes->cpu.bus.apu, 0, sizeof(nes->cpu.bus.apu));
+
+    if (nes->cpu.bus.rom.prg_ram)
+        memset(nes->cpu.bus.rom.prg_ram, 0, PRG_RAM_SIZE);
+
+    nes_reset(nes);
+}
+
+static bool nes_loaded(NesMachine *nes, bool loaded)
+{
+    nes->loaded = loaded;
+
+    if (!nes->loaded)
+    {
+        fprintf(stderr, "could not load rom!\n");
+        return false;
+    }
+
+    nes_power_cycle(nes);
+    return true;
+}
+
+bool nes_load(NesMachine *nes, const unsigned char data[], size_t length)
+{
+    return nes_loaded(nes, rom_load(&nes->cpu.bus.rom, data, length));
+}
+
+bool nes_load_file(NesMachine *nes, const char *filename)
+{
+    return nes_loaded(nes, rom_map(&nes->cpu.bus.rom, filename));
+}
+
+bool nes_load_shared(NesMachine *nes, const NesMachine *source)
+{
+    if (!source->loaded)
+        return false;
+
+    // the rom image is never written, so every instance can read one copy
+    return nes_loaded(nes, rom_share(&nes->cpu.bus.rom, &source->cpu.bus.rom));
+}
+
+void nes_set_palette(NesMachine *nes, const NesPalette *palette)
+{
+    nes->palette = palette;
+    nes->cpu.bus.ppu.palette = palette;
+}
+
+void nes_set_buttons(NesMachine *nes, unsigned char joypad1, unsigned char joypad2)
+{
+    nes->cpu.bus.joypad1.button_status = joypad1;
+    nes->cpu.bus.joypad2.button_status = joypad2;
+}
+
+void nes_step(NesMachine *nes, bool render)
+{
+    if (!nes->loaded)
+        return;
+
+    // runs up to the start of the next vblank
+    nes->render = render;
+    nes->frame_done = false;
+
+    while (!nes->frame_done)
+        cpu_interpret(&nes->cpu);
+}
+
+void nes_step_ahead(NesMachine *nes, unsigned int frames)
+{
+    if (!frames || !nes->loaded)
+    {
+        nes_step(nes, true);
+        return;
+    }
+
+    nes_step(nes, false);
+
+    // only the last hidden frame is drawn, then time goes back to the real one
+    size_t          length = state_save(&nes->cpu, nes->ahead_state, sizeof(nes->ahead_state));
+    unsigned int    frame_count = nes->frame_count;
+
+    for (unsigned int n = 1; n <= frames; n++)
+        nes_step(nes, n == frames);
+
+    state_load(&nes->cpu, nes->ahead_state, length);
+    nes->frame_count = frame_count;
+}
+
+size_t nes_save_state(NesMachine *nes, unsigned char *buffer, size_t capacity)
+{
+    return state_save(&nes->cpu, buffer, capacity);
+}
+
+bool nes_load_state(NesMachine *nes, const unsigned char *buffer, size_t length)
+{
+    return nes->loaded && state_load(&nes->cpu, buffer, length);
+}
+
+uint64_t nes_state_hash(const NesMachine *nes)
+{
+    return state_hash(&nes->cpu);
+}
+
+uint64_t nes_rom_hash(const NesMachine *nes)
+{
+    const Rom *rom = &nes->cpu.bus.rom;
+
+    if (!nes->loaded)
+        return 0;
+
+    return hash_xxh64(rom->chr_rom, rom->chr_len, hash_xxh64(rom->prg_rom, rom->prg_len, 0));
+}
+
+NesClone *nes_clone(NesMachine *nes)
+{
+    NesClone *clone = clone_take(&nes->cpu, nes->base);
+
+    if (!clone)
+        return NULL;
+
+    // later clones share whatever is still unchanged since this one
+    clone_release(nes->base);
+    nes->base = clone_retain(clone);
+
+    return clone;
+}
+
+bool nes_restore(NesMachine *nes, NesClone *clone)
+{
+    if (!nes->loaded)
+        return false;
+
+    clone_restore(&nes->cpu, clone, nes->base);
+
+    clone_release(nes->base);
+    nes->base = clone_retain(clone);
+
+    return true;
+}
+
+void nes_clone_free(NesClone *clone)
+{
+    clone_release(clone);
+}
+
+const Frame *nes_frame(const NesMachine *nes)
+{
+    return &nes->frame;
+}
+
+unsigned int nes_frame_count(const NesMachine *nes)
+{
+    return nes->frame_count;
+}
+
+CPU *nes_cpu(NesMachine *nes)
+{
+    return &nes->cpu;
+}
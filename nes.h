@@ -0,0 +1,45 @@
+#ifndef NES_H
+#define NES_H
+
+#include "emu.h"
+
+// one emulator instance, everything it changes lives behind this handle
+typedef struct NesMachine NesMachine;
+typedef struct NesClone NesClone;
+
+NesMachine *nes_create();
+void nes_destroy(NesMachine *nes);
+
+// data is copied, a file is mapped and read from in place
+bool nes_load(NesMachine *nes, const uint8_t data[], size_t length);
+bool nes_load_file(NesMachine *nes, const char *filename);
+// source has to outlive nes, its rom image is used in place
+bool nes_load_shared(NesMachine *nes, const NesMachine *source);
+void nes_reset(NesMachine *nes);
+// like switching the console off and on, a reset keeps more than this
+void nes_power_cycle(NesMachine *nes);
+
+void nes_set_palette(NesMachine *nes, const NesPalette *palette);
+void nes_set_buttons(NesMachine *nes, uint8_t joypad1, uint8_t joypad2);
+
+void nes_step(NesMachine *nes, bool render);
+void nes_step_ahead(NesMachine *nes, unsigned int frames);
+
+size_t nes_save_state(NesMachine *nes, uint8_t *buffer, size_t capacity);
+bool nes_load_state(NesMachine *nes, const uint8_t *buffer, size_t length);
+// cheap enough to call every frame, equal machines hash the same
+uint64_t nes_state_hash(const NesMachine *nes);
+// hash of the prg and chr data, 0 when nothing is loaded
+uint64_t nes_rom_hash(const NesMachine *nes);
+
+// copy-on-write snapshots, unchanged memory pages are shared between them,
+// nes_clone returns NULL when it runs out of memory
+NesClone *nes_clone(NesMachine *nes);
+bool nes_restore(NesMachine *nes, NesClone *clone);
+void nes_clone_free(NesClone *clone);
+
+const Frame *nes_frame(const NesMachine *nes);
+unsigned int nes_frame_count(const NesMachine *nes);
+CPU *nes_cpu(NesMachine *nes);
+
+#endif
@@ -0,0 +1,381 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include "netplay.h"
+
+// a packet is the first frame (u32), a count and that many local inputs
+// starting at the oldest one the peer has not acknowledged, then the frame
+// the sender has remote input up to (u32) and a state hash the sender will
+// not roll back past (u32 frame, u64 hash), all little endian
+
+#define NET_MAX_INPUTS      32
+
+static uint64_t net_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void net_put32(uint8_t *data, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        data[i] = (value >> (i << 3)) & 0xFF;
+}
+
+static uint32_t net_get32(const uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+bool net_udp_open(NetTransport *transport, unsigned short port, const char *host, unsigned short peer_port)
+{
+    struct addrinfo hints = { 0 },
+                    *peer;
+
+    struct sockaddr_in local = { 0 };
+    char service[8];
+
+    transport->kind = NET_UDP;
+    transport->other = NULL;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%u", peer_port);
+
+    if (getaddrinfo(host, service, &hints, &peer) != 0)
+    {
+        printf("could not resolve %s!\n", host);
+        return false;
+    }
+
+    memcpy(&transport->peer, peer->ai_addr, peer->ai_addrlen);
+    transport->peer_length = peer->ai_addrlen;
+    freeaddrinfo(peer);
+
+    transport->socket = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (transport->socket < 0)
+    {
+        printf("could not open socket!\n");
+        return false;
+    }
+
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    // the emulation thread polls, it never waits on the network
+    if (bind(transport->socket, (struct sockaddr *)&local, sizeof(local)) < 0
+    || fcntl(transport->socket, F_SETFL, fcntl(transport->socket, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        printf("could not bind udp port %u!\n", port);
+        close(transport->socket);
+        return false;
+    }
+
+    return true;
+}
+
+void net_loopback_pair(NetTransport *a, NetTransport *b, unsigned int delay, unsigned int jitter, unsigned int loss)
+{
+    NetTransport *ends[2] = { a, b };
+
+    for (int i = 0; i < 2; i++)
+    {
+        ends[i]->kind = NET_LOOPBACK;
+        ends[i]->socket = -1;
+        ends[i]->other = ends[i ^ 1];
+        ends[i]->first = 0;
+        ends[i]->count = 0;
+        ends[i]->delay = delay;
+        ends[i]->jitter = jitter;
+        ends[i]->loss = loss;
+        ends[i]->seed = i + 1;
+    }
+}
+
+void net_close(NetTransport *transport)
+{
+    if (transport->kind == NET_UDP && transport->socket >= 0)
+        close(transport->socket);
+
+    transport->socket = -1;
+}
+
+static unsigned int net_random(NetTransport *transport)
+{
+    transport->seed = transport->seed * 1103515245 + 12345;
+    return transport->seed >> 16;
+}
+
+bool net_send(NetTransport *transport, const uint8_t *data, size_t length)
+{
+    if (length > NET_PACKET_SIZE)
+        return false;
+
+    if (transport->kind == NET_UDP)
+        return sendto(transport->socket, data, length, 0, (struct sockaddr *)&transport->peer, transport->peer_length) == length;
+
+    NetTransport *other = transport->other;
+
+    // a full inbox or an unlucky roll is a lost packet, same as on the wire
+    if (other->count == NET_QUEUE_LENGTH
+    || (transport->loss && net_random(transport) % 100 < transport->loss))
+        return true;
+
+    NetPacket *packet = &other->inbox[(other->first + other->count) % NET_QUEUE_LENGTH];
+
+    memcpy(packet->data, data, length);
+    packet->length = length;
+    packet->deliver = net_now() + transport->delay;
+
+    if (transport->jitter)
+        packet->deliver += net_random(transport) % (transport->jitter + 1);
+
+    other->count++;
+
+    return true;
+}
+
+size_t net_receive(NetTransport *transport, uint8_t *data, size_t capacity)
+{
+    if (transport->kind == NET_UDP)
+    {
+        ssize_t length = recvfrom(transport->socket, data, capacity, 0, NULL, NULL);
+
+        if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            printf("udp receive failed!\n");
+
+        return length > 0 ? length : 0;
+    }
+
+    NetPacket *packet = &transport->inbox[transport->first];
+
+    // in order, a jittered packet holds up the ones behind it
+    if (!transport->count || packet->deliver > net_now() || packet->length > capacity)
+        return 0;
+
+    memcpy(data, packet->data, packet->length);
+    transport->first = (transport->first + 1) % NET_QUEUE_LENGTH;
+    transport->count--;
+
+    return packet->length;
+}
+
+void net_init(NetSession *session, NesMachine *nes, NetTransport *transport, int player)
+{
+    // both sides start from power on
+    nes_power_cycle(nes);
+
+    session->nes = nes;
+    session->transport = transport;
+    session->player = player;
+    session->frame = 0;
+    session->confirmed = 0;
+    session->acked = 0;
+
+    memset(session->local_input, 0, sizeof(session->local_input));
+    memset(session->remote_input, 0, sizeof(session->remote_input));
+    memset(session->state_lengths, 0, sizeof(session->state_lengths));
+
+    session->hashes[0] = nes_state_hash(nes);
+    session->sync_pending = false;
+    session->desynced = false;
+    session->rollbacks = 0;
+    session->max_resimulated = 0;
+    session->max_resimulate_ms = 0;
+}
+
+static void net_send_inputs(NetSession *session, unsigned int end)
+{
+    uint8_t         packet[NET_PACKET_SIZE];
+    unsigned int    start = session->acked,
+                    count = end - start,
+                    sync_frame = session->frame ? session->frame - 1 : 0;
+
+    if (count > NET_MAX_INPUTS)
+        count = NET_MAX_INPUTS;
+
+    // the newest frame whose state every input before it is known for
+    if (sync_frame > session->confirmed)
+        sync_frame = session->confirmed;
+
+    uint64_t hash = session->hashes[sync_frame % NET_HISTORY];
+
+    net_put32(packet, start);
+    packet[4] = count;
+
+    for (unsigned int i = 0; i < count; i++)
+        packet[5 + i] = session->local_input[(start + i) % NET_HISTORY];
+
+    net_put32(&packet[5 + count], session->confirmed);
+    net_put32(&packet[9 + count], sync_frame);
+    net_put32(&packet[13 + count], hash & 0xFFFFFFFF);
+    net_put32(&packet[17 + count], hash >> 32);
+
+    net_send(session->transport, packet, 21 + count);
+}
+
+// takes in everything the peer sent, returns the oldest frame that ran
+// with a wrong prediction or session->frame if there is none
+static unsigned int net_poll(NetSession *session)
+{
+    uint8_t         packet[NET_PACKET_SIZE];
+    size_t          length;
+    unsigned int    rollback = session->frame;
+
+    while ((length = net_receive(session->transport, packet, sizeof(packet))) > 0)
+    {
+        if (length < 5 || length != 21 + packet[4] || packet[4] > NET_MAX_INPUTS)
+            continue;
+
+        unsigned int    start = net_get32(packet),
+                        count = packet[4],
+                        ack = net_get32(&packet[5 + count]),
+                        sync_frame = net_get32(&packet[9 + count]);
+
+        // only the next unknown frame onwards, and never past the history
+        for (unsigned int f = start; f < start + count; f++)
+        {
+            if (f < session->confirmed)
+                continue;
+
+            if (f > session->confirmed || f >= session->frame + NET_HISTORY - NET_MAX_ROLLBACK - 1)
+                break;
+
+            uint8_t input = packet[5 + f - start];
+
+            if (f < session->frame && session->remote_input[f % NET_HISTORY] != input && f < rollback)
+                rollback = f;
+
+            session->remote_input[f % NET_HISTORY] = input;
+            session->confirmed++;
+        }
+
+        if (ack > session->acked && ack <= session->frame)
+            session->acked = ack;
+
+        if (!session->sync_pending || sync_frame > session->sync_frame)
+        {
+            session->sync_frame = sync_frame;
+            session->sync_hash = net_get32(&packet[13 + count]) | (uint64_t)net_get32(&packet[17 + count]) << 32;
+            session->sync_pending = true;
+        }
+    }
+
+    return rollback;
+}
+
+// saves the state at the start of session->frame and runs it
+static void net_run_frame(NetSession *session, bool render)
+{
+    unsigned int    frame = session->frame,
+                    slot = frame % (NET_MAX_ROLLBACK + 1);
+
+    uint8_t         local,
+                    remote;
+
+    session->state_lengths[slot] = nes_save_state(session->nes, session->states[slot], STATE_MAX_SIZE);
+    session->hashes[frame % NET_HISTORY] = nes_state_hash(session->nes);
+
+    // the peer keeps doing what it last did
+    if (frame >= session->confirmed)
+        session->remote_input[frame % NET_HISTORY] = session->confirmed
+            ? session->remote_input[(session->confirmed - 1) % NET_HISTORY] : 0;
+
+    local = session->local_input[frame % NET_HISTORY];
+    remote = session->remote_input[frame % NET_HISTORY];
+
+    if (session->player == 0)
+        nes_set_buttons(session->nes, local, remote);
+    else
+        nes_set_buttons(session->nes, remote, local);
+
+    nes_step(session->nes, render);
+    session->frame++;
+}
+
+static void net_rollback(NetSession *session, unsigned int frame)
+{
+    struct timespec start, end;
+    unsigned int    slot = frame % (NET_MAX_ROLLBACK + 1),
+                    target = session->frame;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    nes_load_state(session->nes, session->states[slot], session->state_lengths[slot]);
+
+    // nothing from the frames run again is shown
+    for (session->frame = frame; session->frame < target;)
+        net_run_frame(session, false);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    session->rollbacks++;
+
+    if (target - frame > session->max_resimulated)
+        session->max_resimulated = target - frame;
+
+    if (ms > session->max_resimulate_ms)
+        session->max_resimulate_ms = ms;
+}
+
+static void net_check_sync(NetSession *session)
+{
+    unsigned int sync_frame = session->sync_frame;
+
+    // wait until the same frame is final here too
+    if (!session->sync_pending || sync_frame > session->confirmed || sync_frame >= session->frame)
+        return;
+
+    session->sync_pending = false;
+
+    if (session->frame - sync_frame > NET_HISTORY || session->desynced)
+        return;
+
+    if (session->hashes[sync_frame % NET_HISTORY] != session->sync_hash)
+    {
+        printf("netplay desynced at frame %u!\n", sync_frame);
+        session->desynced = true;
+    }
+}
+
+static void net_catch_up(NetSession *session)
+{
+    unsigned int rollback = net_poll(session);
+
+    if (rollback < session->frame)
+        net_rollback(session, rollback);
+
+    net_check_sync(session);
+}
+
+void net_update(NetSession *session)
+{
+    net_catch_up(session);
+    net_send_inputs(session, session->frame);
+}
+
+bool net_advance(NetSession *session, uint8_t buttons, bool render)
+{
+    net_catch_up(session);
+
+    // too far ahead to roll back to the peer's next input, keep resending
+    if (session->frame >= session->confirmed + NET_MAX_ROLLBACK)
+    {
+        net_send_inputs(session, session->frame);
+        return false;
+    }
+
+    session->local_input[session->frame % NET_HISTORY] = buttons;
+    net_send_inputs(session, session->frame + 1);
+    net_run_frame(session, render);
+
+    return true;
+}
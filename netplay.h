@@ -0,0 +1,93 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include <sys/socket.h>
+#include "nes.h"
+#include "state.h"
+
+// frames the local side may run ahead of the last input it has from the peer
+#define NET_MAX_ROLLBACK    12
+
+// inputs and state hashes are kept for this many frames, a power of two
+#define NET_HISTORY         64
+
+#define NET_PACKET_SIZE     64
+#define NET_QUEUE_LENGTH    256
+
+enum NetTransportKind
+{
+    NET_UDP,
+    NET_LOOPBACK
+};
+
+typedef struct NetPacket
+{
+    uint8_t         data[NET_PACKET_SIZE];
+    unsigned short  length;
+
+    // loopback only, monotonic ms the packet may be received at
+    uint64_t        deliver;
+} NetPacket;
+
+typedef struct NetTransport NetTransport;
+
+struct NetTransport
+{
+    enum NetTransportKind kind;
+
+    // udp, non-blocking socket and the address packets go to
+    int                     socket;
+    struct sockaddr_storage peer;
+    socklen_t               peer_length;
+
+    // loopback, packets sent land in the other end's inbox after delay ms
+    // plus up to jitter ms, loss out of 100 are dropped on the way
+    NetTransport    *other;
+    NetPacket       inbox[NET_QUEUE_LENGTH];
+    unsigned int    first, count;
+    unsigned int    delay, jitter, loss, seed;
+};
+
+bool net_udp_open(NetTransport *transport, unsigned short port, const char *host, unsigned short peer_port);
+// both ends have to stay where they are while the other one is in use
+void net_loopback_pair(NetTransport *a, NetTransport *b, unsigned int delay, unsigned int jitter, unsigned int loss);
+void net_close(NetTransport *transport);
+
+bool net_send(NetTransport *transport, const uint8_t *data, size_t length);
+// length of the next packet, 0 when there is none
+size_t net_receive(NetTransport *transport, uint8_t *data, size_t capacity);
+
+typedef struct NetSession
+{
+    NesMachine      *nes;
+    NetTransport    *transport;
+    int             player;
+
+    // next frame to run, remote input is known for every frame before
+    // confirmed, the peer has ours for every frame before acked
+    unsigned int    frame, confirmed, acked;
+
+    // by frame % NET_HISTORY, remote input past confirmed is predicted
+    uint8_t         local_input[NET_HISTORY], remote_input[NET_HISTORY];
+    uint64_t        hashes[NET_HISTORY];
+
+    // state at the start of each frame that can still be rolled back to
+    uint8_t         states[NET_MAX_ROLLBACK + 1][STATE_MAX_SIZE];
+    size_t          state_lengths[NET_MAX_ROLLBACK + 1];
+
+    // newest state hash from the peer that has not been checked yet
+    unsigned int    sync_frame;
+    uint64_t        sync_hash;
+    bool            sync_pending:1, desynced:1;
+
+    unsigned int    rollbacks, max_resimulated;
+    double          max_resimulate_ms;
+} NetSession;
+
+void net_init(NetSession *session, NesMachine *nes, NetTransport *transport, int player);
+// runs one frame with the local buttons, false while too far ahead of the peer
+bool net_advance(NetSession *session, uint8_t buttons, bool render);
+// takes in the peer's input and resends ours without running a frame
+void net_update(NetSession *session);
+
+#endif
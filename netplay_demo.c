@@ -0,0 +1,218 @@
+#include <time.h>
+#include "netplay.h"
+
+static void usage()
+{
+    printf("usage: nes_netplay <rom.nes> [-n frames] [-d delay] [-j jitter] [-l loss]\n");
+    printf("       nes_netplay <rom.nes> -u port host:port -p player [-n frames]\n");
+    printf("  without -u both players run here over a loopback with delay and jitter\n");
+    printf("  in ms and loss in percent, and are checked against an offline run\n");
+    printf("  -u plays one side over udp, both sides print their final state hash\n");
+}
+
+// scripted buttons, each player holds a random pad for 10 to 40 frames
+static uint8_t demo_buttons(int player, unsigned int frame)
+{
+    unsigned int    hold = 10 + (player * 7919 + 13) % 31,
+                    seed = (frame / hold) * 2654435761u + player * 40503u;
+
+    seed ^= seed >> 15;
+    seed *= 2246822519u;
+    seed ^= seed >> 13;
+
+    return seed & 0xFF;
+}
+
+static void demo_wait(struct timespec *next)
+{
+    // 60 frames a second, from a fixed start so sleeps do not drift
+    next->tv_nsec += 16666667;
+
+    if (next->tv_nsec >= 1000000000)
+    {
+        next->tv_nsec -= 1000000000;
+        next->tv_sec++;
+    }
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+}
+
+static void demo_stats(const NetSession *session)
+{
+    printf("player %d: %u rollbacks, at most %u frames run again in %.2f ms\n",
+        session->player + 1, session->rollbacks, session->max_resimulated, session->max_resimulate_ms);
+}
+
+static int demo_loopback(const char *rom_file, unsigned int target, unsigned int delay, unsigned int jitter, unsigned int loss)
+{
+    NesMachine      *machines[3] = { NULL };
+    NetTransport    *transports = calloc(2, sizeof(NetTransport));
+    NetSession      *sessions = calloc(2, sizeof(NetSession));
+    int             result = 1;
+
+    for (int i = 0; i < 3; i++)
+    {
+        machines[i] = nes_create();
+
+        if (!nes_load_file(machines[i], rom_file))
+            goto done;
+    }
+
+    net_loopback_pair(&transports[0], &transports[1], delay, jitter, loss);
+    net_init(&sessions[0], machines[0], &transports[0], 0);
+    net_init(&sessions[1], machines[1], &transports[1], 1);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    // both keep exchanging input until every frame is confirmed on both
+    while (sessions[0].confirmed < target || sessions[1].confirmed < target)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            NetSession *session = &sessions[i];
+
+            if (session->frame < target)
+                net_advance(session, demo_buttons(i, session->frame), false);
+            else
+                net_update(session);
+        }
+
+        demo_wait(&next);
+    }
+
+    for (unsigned int frame = 0; frame < target; frame++)
+    {
+        nes_set_buttons(machines[2], demo_buttons(0, frame), demo_buttons(1, frame));
+        nes_step(machines[2], false);
+    }
+
+    uint64_t    hashes[3];
+
+    for (int i = 0; i < 3; i++)
+        hashes[i] = nes_state_hash(machines[i]);
+
+    demo_stats(&sessions[0]);
+    demo_stats(&sessions[1]);
+    printf("final state hash %016llx %016llx, offline %016llx\n",
+        (unsigned long long)hashes[0], (unsigned long long)hashes[1], (unsigned long long)hashes[2]);
+
+    result = hashes[0] == hashes[2] && hashes[1] == hashes[2]
+            && !sessions[0].desynced && !sessions[1].desynced ? 0 : 1;
+
+done:
+    for (int i = 0; i < 3; i++)
+        if (machines[i])
+            nes_destroy(machines[i]);
+
+    free(transports);
+    free(sessions);
+
+    return result;
+}
+
+static int demo_udp(const char *rom_file, unsigned int target, unsigned short port, char *peer, int player)
+{
+    char            *colon = strrchr(peer, ':');
+    NesMachine      *nes = nes_create();
+    NetTransport    transport;
+    NetSession      *session = calloc(1, sizeof(NetSession));
+
+    if (!colon || player < 0 || player > 1)
+    {
+        usage();
+        goto fail;
+    }
+
+    *colon = '\0';
+
+    if (!nes_load_file(nes, rom_file) || !net_udp_open(&transport, port, peer, atoi(colon + 1)))
+        goto fail;
+
+    net_init(session, nes, &transport, player);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    // keeps resending for a few seconds after the end for the peer's sake
+    for (unsigned int linger = 180; session->confirmed < target || linger > 0; demo_wait(&next))
+    {
+        if (session->frame < target)
+            net_advance(session, demo_buttons(player, session->frame), false);
+        else
+        {
+            net_update(session);
+
+            if (session->confirmed >= target)
+                linger--;
+        }
+    }
+
+    demo_stats(session);
+    printf("final state hash %016llx\n", (unsigned long long)nes_state_hash(nes));
+
+    int result = session->desynced ? 1 : 0;
+
+    net_close(&transport);
+    free(session);
+    nes_destroy(nes);
+
+    return result;
+
+fail:
+    free(session);
+    nes_destroy(nes);
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char      *rom_file = NULL;
+    char            *peer = NULL;
+
+    unsigned int    target = 600,
+                    delay = 50,
+                    jitter = 0,
+                    loss = 0,
+                    port = 0;
+
+    int             player = -1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            target = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+            delay = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            jitter = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-l") && i + 1 < argc)
+            loss = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "-u") && i + 2 < argc)
+        {
+            port = strtoul(argv[++i], NULL, 10);
+            peer = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            player = atoi(argv[++i]) - 1;
+        else if (!rom_file)
+            rom_file = argv[i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!rom_file)
+    {
+        usage();
+        return 1;
+    }
+
+    if (peer)
+        return demo_udp(rom_file, target, port, peer, player);
+
+    return demo_loopback(rom_file, target, delay, jitter, loss);
+}
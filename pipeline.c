@@ -0,0 +1,156 @@
+#include <sched.h>
+#include "pipeline.h"
+
+void frame_queue_init(FrameQueue *queue)
+{
+    for (int i = 0; i < 3; i++)
+        frame_init(&queue->frames[i]);
+
+    queue->back = 0;
+    queue->front = 1;
+    queue->shown = false;
+    atomic_init(&queue->middle, 2);
+}
+
+Frame *frame_queue_back(FrameQueue *queue)
+{
+    return &queue->frames[queue->back];
+}
+
+void frame_queue_publish(FrameQueue *queue)
+{
+    // hand the finished frame over and take whatever was in the middle
+    unsigned int old = atomic_exchange_explicit(&queue->middle, 
+                                                queue->back | FRAME_QUEUE_FRESH, 
+                                                memory_order_acq_rel);
+
+    queue->back = old & 0b11;
+}
+
+Frame *frame_queue_front(FrameQueue *queue)
+{
+    if (atomic_load_explicit(&queue->middle, memory_order_relaxed) & FRAME_QUEUE_FRESH)
+    {
+        unsigned int old = atomic_exchange_explicit(&queue->middle, 
+                                                    queue->front, 
+                                                    memory_order_acq_rel);
+
+        queue->front = old & 0b11;
+        queue->shown = true;
+    }
+
+    return queue->shown ? &queue->frames[queue->front] : NULL;
+}
+
+// whether the consumer would get a newer frame, without taking it
+bool frame_queue_fresh(FrameQueue *queue)
+{
+    return atomic_load_explicit(&queue->middle, memory_order_relaxed) & FRAME_QUEUE_FRESH;
+}
+
+static void *pipeline_run(void *data)
+{
+    RenderPipeline  *pipeline = data;
+    unsigned char   next = 0;
+
+    while (!atomic_load_explicit(&pipeline->quit, memory_order_relaxed))
+    {
+        if (atomic_load_explicit(&pipeline->log_states[next], memory_order_acquire) != LOG_READY)
+        {
+            sched_yield();
+            continue;
+        }
+
+        PpuWriteLog *log = &pipeline->logs[next];
+
+        ppu_render_log(&pipeline->ppu, log, frame_queue_back(&pipeline->frames));
+
+        if (log->render)
+            frame_queue_publish(&pipeline->frames);
+
+        atomic_store_explicit(&pipeline->log_states[next], LOG_FREE, memory_order_release);
+        next ^= 1;
+    }
+
+    return NULL;
+}
+
+static void pipeline_reset_log(PpuWriteLog *log)
+{
+    log->count = 0;
+    log->overflow = false;
+    log->render = false;
+}
+
+bool pipeline_start(RenderPipeline *pipeline, PPU *ppu)
+{
+    // the render thread starts from the memory the PPU has right now
+    pipeline->ppu = *ppu;
+    pipeline->ppu.log = NULL;
+    pipeline->ppu.frame = NULL;
+    ppu_set_mirroring(&pipeline->ppu, ppu->mirroring);
+
+    if (ppu->chr_ram)
+    {
+        memcpy(pipeline->chr_ram, ppu->chr_ram, sizeof(pipeline->chr_ram));
+        pipeline->ppu.chr_ram = pipeline->chr_ram;
+        pipeline->ppu.chr_rom = pipeline->chr_ram;
+        ppu_map_chr(&pipeline->ppu);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        pipeline_reset_log(&pipeline->logs[i]);
+        atomic_init(&pipeline->log_states[i], LOG_FREE);
+    }
+
+    frame_queue_init(&pipeline->frames);
+    atomic_init(&pipeline->quit, false);
+    pipeline->fill = 0;
+
+    if (pthread_create(&pipeline->thread, NULL, pipeline_run, pipeline) != 0)
+    {
+        printf("could not start render thread!\n");
+        return false;
+    }
+
+    ppu->log = &pipeline->logs[0];
+    return true;
+}
+
+void pipeline_submit(RenderPipeline *pipeline, PPU *ppu, bool render)
+{
+    ppu_log_close(ppu);
+    pipeline->logs[pipeline->fill].render = render;
+
+    atomic_store_explicit(&pipeline->log_states[pipeline->fill], LOG_READY, memory_order_release);
+    pipeline->fill ^= 1;
+
+    // only waits when the render thread is a whole frame behind
+    while (atomic_load_explicit(&pipeline->log_states[pipeline->fill], memory_order_acquire) != LOG_FREE)
+        sched_yield();
+
+    pipeline_reset_log(&pipeline->logs[pipeline->fill]);
+    ppu->log = &pipeline->logs[pipeline->fill];
+}
+
+Frame *pipeline_frame(RenderPipeline *pipeline)
+{
+    return frame_queue_front(&pipeline->frames);
+}
+
+bool pipeline_frame_ready(RenderPipeline *pipeline)
+{
+    return frame_queue_fresh(&pipeline->frames);
+}
+
+void pipeline_stop(RenderPipeline *pipeline, PPU *ppu)
+{
+    if (!ppu->log)
+        return;
+
+    atomic_store(&pipeline->quit, true);
+    pthread_join(pipeline->thread, NULL);
+
+    ppu->log = NULL;
+}
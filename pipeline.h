@@ -0,0 +1,60 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "emu.h"
+
+enum LogState
+{
+    LOG_FREE,
+    LOG_READY
+};
+
+// marks the middle frame as newer than the one the presenter holds
+#define FRAME_QUEUE_FRESH   4
+
+typedef struct FrameQueue
+{
+    // one frame being drawn, one being shown and the newest finished one
+    Frame           frames[3];
+
+    // back is only touched by the producer, front by the consumer
+    unsigned char   back, front;
+    bool            shown;
+
+    atomic_uint     middle;
+} FrameQueue;
+
+typedef struct RenderPipeline
+{
+    // render side copy of the PPU, only touched by the render thread
+    PPU             ppu;
+
+    // its own chr ram, kept in step through the write log
+    unsigned char   chr_ram[CHR_RAM_SIZE];
+
+    // the emulation thread fills one log while the other one is drawn
+    PpuWriteLog     logs[2];
+    atomic_int      log_states[2];
+    unsigned char   fill;
+
+    FrameQueue      frames;
+
+    atomic_bool     quit;
+    pthread_t       thread;
+} RenderPipeline;
+
+void frame_queue_init(FrameQueue *queue);
+Frame *frame_queue_back(FrameQueue *queue);
+void frame_queue_publish(FrameQueue *queue);
+Frame *frame_queue_front(FrameQueue *queue);
+bool frame_queue_fresh(FrameQueue *queue);
+
+bool pipeline_start(RenderPipeline *pipeline, PPU *ppu);
+void pipeline_submit(RenderPipeline *pipeline, PPU *ppu, bool render);
+Frame *pipeline_frame(RenderPipeline *pipeline);
+bool pipeline_frame_ready(RenderPipeline *pipeline);
+void pipeline_stop(RenderPipeline *pipeline, PPU *ppu);
+
+#endif
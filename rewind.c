@@ -0,0 +1,227 @@
+#include "rewind.h"
+
+// a delta is the xor of two states, stored as runs of
+// [u16 zero bytes][u16 literal bytes][literals], both counts little endian
+
+static size_t rewind_encode(const uint8_t *older, size_t older_length, 
+                            const uint8_t *newer, size_t newer_length, uint8_t *out)
+{
+    size_t  length = older_length > newer_length ? older_length : newer_length,
+            pos = 0,
+            i = 0;
+
+    while (i < length)
+    {
+        size_t zeros = 0, literals = 0;
+
+        #define XOR_AT(n) (((n) < older_length ? older[n] : 0) ^ ((n) < newer_length ? newer[n] : 0))
+
+        while (i + zeros < length && zeros < 0xFFFF && !XOR_AT(i + zeros))
+            zeros++;
+
+        while (i + zeros + literals < length && literals < 0xFFFF && XOR_AT(i + zeros + literals))
+            literals++;
+
+        out[pos++] = zeros & 0xFF;
+        out[pos++] = zeros >> 8;
+        out[pos++] = literals & 0xFF;
+        out[pos++] = literals >> 8;
+
+        for (size_t n = i + zeros; n < i + zeros + literals; n++)
+            out[pos++] = XOR_AT(n);
+
+        #undef XOR_AT
+
+        i += zeros + literals;
+    }
+
+    return pos;
+}
+
+static void rewind_decode(const uint8_t *delta, size_t delta_length, uint8_t *state)
+{
+    size_t pos = 0, i = 0;
+
+    while (pos + 4 <= delta_length)
+    {
+        size_t  zeros = delta[pos] | delta[pos + 1] << 8,
+                literals = delta[pos + 2] | delta[pos + 3] << 8;
+
+        pos += 4;
+        i += zeros;
+
+        for (size_t n = 0; n < literals; n++)
+            state[i++] ^= delta[pos++];
+    }
+}
+
+bool rewind_init(Rewind *rewind, size_t capacity, unsigned int interval)
+{
+    rewind->capacity = capacity;
+    rewind->ring = malloc(capacity);
+
+    // grows with the number of deltas that actually fit in the ring
+    rewind->max_entries = REWIND_ENTRIES;
+    rewind->entries = malloc(rewind->max_entries * sizeof(RewindEntry));
+
+    if (!rewind->ring || !rewind->entries)
+    {
+        printf("could not allocate rewind buffer!\n");
+        rewind_free(rewind);
+        return false;
+    }
+
+    rewind->first = 0;
+    rewind->count = 0;
+    rewind->current_length = 0;
+    rewind->interval = interval ? interval : 1;
+    rewind->frames = 0;
+
+    return true;
+}
+
+void rewind_free(Rewind *rewind)
+{
+    free(rewind->ring);
+    free(rewind->entries);
+
+    rewind->ring = NULL;
+    rewind->entries = NULL;
+}
+
+static RewindEntry *rewind_entry(Rewind *rewind, unsigned int n)
+{
+    return &rewind->entries[(rewind->first + n) % rewind->max_entries];
+}
+
+static void rewind_drop_oldest(Rewind *rewind)
+{
+    rewind->first = (rewind->first + 1) % rewind->max_entries;
+    rewind->count--;
+}
+
+// doubles the entry table, oldest entry first again
+static bool rewind_grow(Rewind *rewind)
+{
+    unsigned int    max_entries = rewind->max_entries * 2;
+    RewindEntry     *entries = malloc(max_entries * sizeof(RewindEntry));
+
+    if (!entries)
+        return false;
+
+    for (unsigned int n = 0; n < rewind->count; n++)
+        entries[n] = *rewind_entry(rewind, n);
+
+    free(rewind->entries);
+
+    rewind->entries = entries;
+    rewind->max_entries = max_entries;
+    rewind->first = 0;
+
+    return true;
+}
+
+// true when [offset, offset + length) overlaps the bytes held by entry
+static bool rewind_overlaps(const RewindEntry *entry, size_t offset, size_t length)
+{
+    return offset < entry->offset + entry->length && entry->offset < offset + length;
+}
+
+// adds the delta back to the current snapshot, dropping the oldest ones
+// it needs the room of
+static void rewind_store(Rewind *rewind, const uint8_t *delta, size_t delta_length)
+{
+    size_t offset = 0;
+
+    if (rewind->count)
+    {
+        RewindEntry *newest = rewind_entry(rewind, rewind->count - 1);
+
+        offset = newest->offset + newest->length;
+
+        // the oldest deltas sit between the newest one and the end
+        if (offset + delta_length > rewind->capacity)
+        {
+            while (rewind_entry(rewind, 0)->offset >= offset)
+                rewind_drop_oldest(rewind);
+
+            offset = 0;
+        }
+    }
+
+    // make room by dropping the oldest deltas the new one would overwrite
+    while (rewind->count && rewind_overlaps(rewind_entry(rewind, 0), offset, delta_length))
+        rewind_drop_oldest(rewind);
+
+    if (rewind->count == rewind->max_entries && !rewind_grow(rewind))
+        rewind_drop_oldest(rewind);
+
+    RewindEntry *entry = rewind_entry(rewind, rewind->count++);
+
+    entry->offset = offset;
+    entry->length = delta_length;
+    entry->state_length = rewind->current_length;
+
+    memcpy(&rewind->ring[offset], delta, delta_length);
+}
+
+void rewind_push(Rewind *rewind, NesMachine *nes)
+{
+    if (rewind->frames++ % rewind->interval)
+        return;
+
+    size_t length = nes_save_state(nes, rewind->scratch, sizeof(rewind->scratch));
+
+    if (!length)
+        return;
+
+    if (rewind->current_length)
+    {
+        size_t delta_length = rewind_encode(rewind->current, rewind->current_length, 
+                                            rewind->scratch, length, rewind->delta);
+
+        // a delta the ring can't hold cuts off everything older, the new
+        // snapshot still becomes the current one
+        if (delta_length > rewind->capacity)
+            rewind->count = 0;
+        else
+            rewind_store(rewind, rewind->delta, delta_length);
+    }
+
+    memcpy(rewind->current, rewind->scratch, length);
+    rewind->current_length = length;
+}
+
+bool rewind_step_back(Rewind *rewind, NesMachine *nes)
+{
+    if (!rewind->current_length)
+        return false;
+
+    bool stepped = rewind->count > 0;
+
+    if (stepped)
+    {
+        RewindEntry *entry = rewind_entry(rewind, --rewind->count);
+
+        if (entry->state_length > rewind->current_length)
+            memset(&rewind->current[rewind->current_length], 0, entry->state_length - rewind->current_length);
+
+        rewind_decode(&rewind->ring[entry->offset], entry->length, rewind->current);
+        rewind->current_length = entry->state_length;
+    }
+
+    rewind->frames = 1;
+    nes_load_state(nes, rewind->current, rewind->current_length);
+
+    return stepped;
+}
+
+size_t rewind_used(const Rewind *rewind)
+{
+    size_t used = 0;
+
+    for (unsigned int n = 0; n < rewind->count; n++)
+        used += rewind->entries[(rewind->first + n) % rewind->max_entries].length;
+
+    return used;
+}
@@ -0,0 +1,42 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "nes.h"
+#include "state.h"
+
+// entries the table starts with, small deltas make it grow
+#define REWIND_ENTRIES      64
+
+typedef struct RewindEntry
+{
+    // delta from the next newer snapshot back to this one
+    uint32_t    offset, length, state_length;
+} RewindEntry;
+
+typedef struct Rewind
+{
+    // compressed deltas in a byte ring, oldest ones are dropped to make room
+    uint8_t         *ring;
+    size_t          capacity;
+
+    RewindEntry     *entries;
+    unsigned int    max_entries, first, count;
+
+    // newest snapshot in full, every delta is taken against it
+    uint8_t         current[STATE_MAX_SIZE], scratch[STATE_MAX_SIZE];
+
+    // a run header per literal byte at worst
+    uint8_t         delta[STATE_MAX_SIZE * 5];
+    size_t          current_length;
+
+    unsigned int    interval, frames;
+} Rewind;
+
+bool rewind_init(Rewind *rewind, size_t capacity, unsigned int interval);
+void rewind_free(Rewind *rewind);
+
+void rewind_push(Rewind *rewind, NesMachine *nes);
+bool rewind_step_back(Rewind *rewind, NesMachine *nes);
+size_t rewind_used(const Rewind *rewind);
+
+#endif
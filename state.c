@@ -0,0 +1,617 @@
+#include "state.h"
+#include "mapper.h"
+
+// a state is "NESS", a version byte and a run of chunks, each a four byte
+// tag, a 32-bit little endian length and the payload; rom data and
+// anything the PPU can rebuild from the rest are left out
+
+typedef struct StateWriter
+{
+    uint8_t     *data;
+    size_t      length, capacity, chunk;
+    bool        overflow;
+} StateWriter;
+
+typedef struct StateReader
+{
+    const uint8_t   *data;
+    size_t          length, pos;
+} StateReader;
+
+enum StateChunk
+{
+    CHUNK_CPU,
+    CHUNK_RAM,
+    CHUNK_JOYPADS,
+    CHUNK_PPU,
+    CHUNK_VRAM,
+    CHUNK_OAM,
+    CHUNK_PALETTE,
+    CHUNK_SCANLINES,
+    CHUNK_SPRITES,
+    CHUNK_APU,
+    CHUNK_CHR_RAM,
+    CHUNK_PRG_RAM,
+    CHUNK_MAPPER,
+    CHUNK_COUNT
+};
+
+static const char CHUNK_TAGS[CHUNK_COUNT][4] = {
+    [CHUNK_CPU]         = "CPU ",
+    [CHUNK_RAM]         = "RAM ",
+    [CHUNK_JOYPADS]     = "JOYP",
+    [CHUNK_PPU]         = "PPU ",
+    [CHUNK_VRAM]        = "VRAM",
+    [CHUNK_OAM]         = "OAM ",
+    [CHUNK_PALETTE]     = "PAL ",
+    [CHUNK_SCANLINES]   = "LINE",
+    [CHUNK_SPRITES]     = "SPRY",
+    [CHUNK_APU]         = "APU ",
+    [CHUNK_CHR_RAM]     = "CHR ",
+    [CHUNK_PRG_RAM]     = "SRAM",
+    [CHUNK_MAPPER]      = "MAPR"
+};
+
+// fixed payload sizes, 0 where the length varies
+static const unsigned short CHUNK_LENGTHS[CHUNK_COUNT] = {
+    [CHUNK_CPU]         = 15,
+    [CHUNK_RAM]         = 2048,
+    [CHUNK_JOYPADS]     = 6,
+    [CHUNK_PPU]         = 19,
+    [CHUNK_VRAM]        = 0,
+    [CHUNK_OAM]         = 256,
+    [CHUNK_PALETTE]     = 32,
+    [CHUNK_SCANLINES]   = FRAME_HEIGHT * 5,
+    [CHUNK_SPRITES]     = 65,
+    [CHUNK_APU]         = 48,
+    [CHUNK_CHR_RAM]     = CHR_RAM_SIZE,
+    [CHUNK_PRG_RAM]     = PRG_RAM_SIZE,
+    [CHUNK_MAPPER]      = sizeof(Mapper)
+};
+
+// cart ram and bank registers are only saved by machines whose cart has them
+static bool state_has_chunk(const CPU *cpu, enum StateChunk chunk)
+{
+    if (chunk == CHUNK_MAPPER)
+        return cpu->bus.rom.mapper != 0;
+
+    if (chunk == CHUNK_CHR_RAM)
+        return cpu->bus.ppu.chr_ram != NULL;
+
+    if (chunk == CHUNK_PRG_RAM)
+        return cpu->bus.rom.prg_ram != NULL;
+
+    return true;
+}
+
+static void state_put(StateWriter *writer, const void *data, size_t length)
+{
+    if (writer->length + length > writer->capacity)
+    {
+        writer->overflow = true;
+        return;
+    }
+
+    memcpy(&writer->data[writer->length], data, length);
+    writer->length += length;
+}
+
+static void state_put8(StateWriter *writer, uint8_t value)
+{
+    state_put(writer, &value, 1);
+}
+
+static void state_put16(StateWriter *writer, uint16_t value)
+{
+    uint8_t bytes[2] = { value & 0xFF, value >> 8 };
+
+    state_put(writer, bytes, 2);
+}
+
+static void state_put32(StateWriter *writer, uint32_t value)
+{
+    uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+
+    state_put(writer, bytes, 4);
+}
+
+static void state_begin_chunk(StateWriter *writer, enum StateChunk chunk)
+{
+    state_put(writer, CHUNK_TAGS[chunk], 4);
+    writer->chunk = writer->length;
+    state_put32(writer, 0);
+}
+
+static void state_end_chunk(StateWriter *writer)
+{
+    if (writer->overflow)
+        return;
+
+    uint32_t length = writer->length - writer->chunk - 4;
+
+    for (int i = 0; i < 4; i++)
+        writer->data[writer->chunk + i] = (length >> (i << 3)) & 0xFF;
+}
+
+static uint8_t state_get8(StateReader *reader)
+{
+    return reader->data[reader->pos++];
+}
+
+static uint16_t state_get16(StateReader *reader)
+{
+    uint16_t value = reader->data[reader->pos] | reader->data[reader->pos + 1] << 8;
+
+    reader->pos += 2;
+    return value;
+}
+
+static uint32_t state_get32(StateReader *reader)
+{
+    uint32_t value = 0;
+
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)reader->data[reader->pos + i] << (i << 3);
+
+    reader->pos += 4;
+    return value;
+}
+
+static void state_get(StateReader *reader, void *data, size_t length)
+{
+    memcpy(data, &reader->data[reader->pos], length);
+    reader->pos += length;
+}
+
+static void state_put_cpu(StateWriter *writer, const CPU *cpu)
+{
+    state_put8(writer, cpu->register_a);
+    state_put8(writer, cpu->register_x);
+    state_put8(writer, cpu->register_y);
+    state_put8(writer, cpu->stack_pointer);
+    state_put8(writer, cpu->status);
+    state_put16(writer, cpu->program_counter);
+    state_put32(writer, cpu->cycles);
+    state_put32(writer, cpu->bus.cycles);
+}
+
+static void state_put_joypads(StateWriter *writer, const Bus *bus)
+{
+    for (const Joypad *joypad = &bus->joypad1; joypad <= &bus->joypad2; joypad++)
+    {
+        state_put8(writer, joypad->strobe);
+        state_put8(writer, joypad->index);
+        state_put8(writer, joypad->button_status);
+    }
+}
+
+static void state_put_ppu(StateWriter *writer, const PPU *ppu)
+{
+    state_put8(writer, ppu->ctrl);
+    state_put8(writer, ppu->mask);
+    state_put8(writer, ppu->status);
+    state_put8(writer, ppu->oam_addr);
+    state_put8(writer, ppu->internal_data_buf);
+    state_put8(writer, ppu->latch);
+    state_put8(writer, ppu->nmi_interrupt | ppu->nmi_write << 1 | ppu->w << 2 | ppu->sprite_no_limit << 3);
+    state_put8(writer, ppu->mirroring);
+    state_put16(writer, ppu->scanline);
+    state_put16(writer, ppu->cycles);
+    state_put16(writer, ppu->v);
+    state_put16(writer, ppu->t);
+    state_put8(writer, ppu->x);
+    state_put16(writer, ppu->sprite_0_hit_dot);
+}
+
+static void state_put_pulse(StateWriter *writer, const Pulse *pulse)
+{
+    state_put8(writer, pulse->sweep);
+    state_put8(writer, pulse->timer_low);
+    state_put8(writer, pulse->timer_high);
+    state_put16(writer, pulse->timer_period);
+    state_put8(writer, pulse->envelope);
+    state_put8(writer, pulse->length_counter);
+    state_put8(writer, pulse->output);
+    state_put8(writer, pulse->length_halt_flag | pulse->const_vol_env_flag << 1);
+}
+
+static void state_put_apu(StateWriter *writer, const APU *apu)
+{
+    state_put8(writer, apu->status);
+    state_put8(writer, apu->ctr_register);
+
+    state_put_pulse(writer, &apu->pulse1);
+    state_put_pulse(writer, &apu->pulse2);
+
+    state_put8(writer, apu->triangle.timer_low);
+    state_put8(writer, apu->triangle.timer_high);
+    state_put16(writer, apu->triangle.timer_period);
+    state_put8(writer, apu->triangle.length_counter);
+    state_put8(writer, apu->triangle.linear_counter);
+    state_put8(writer, apu->triangle.output);
+    state_put8(writer, apu->triangle.length_halt);
+
+    state_put8(writer, apu->noise.timer_low);
+    state_put8(writer, apu->noise.timer_high);
+    state_put8(writer, apu->noise.envelope);
+    state_put8(writer, apu->noise.period);
+    state_put8(writer, apu->noise.length_counter);
+    state_put8(writer, apu->noise.linear_shift);
+    state_put8(writer, apu->noise.output);
+    state_put8(writer, apu->noise.length_halt | apu->noise.constant << 1 | apu->noise.mode << 2);
+
+    state_put8(writer, apu->dmc.timer_low);
+    state_put8(writer, apu->dmc.timer_high);
+    state_put8(writer, apu->dmc.memory_reader);
+    state_put8(writer, apu->dmc.sample_buffer);
+    state_put8(writer, apu->dmc.output_unit);
+    state_put8(writer, apu->dmc.rate);
+    state_put8(writer, apu->dmc.output);
+    state_put16(writer, apu->dmc.sample_addr);
+    state_put16(writer, apu->dmc.sample_length);
+    state_put8(writer, apu->dmc.loop);
+}
+
+static void state_get_pulse(StateReader *reader, Pulse *pulse)
+{
+    pulse->sweep = state_get8(reader);
+    pulse->timer_low = state_get8(reader);
+    pulse->timer_high = state_get8(reader);
+    pulse->timer_period = state_get16(reader);
+    pulse->envelope = state_get8(reader);
+    pulse->length_counter = state_get8(reader);
+    pulse->output = state_get8(reader);
+
+    unsigned char flags = state_get8(reader);
+
+    pulse->length_halt_flag = flags & 1;
+    pulse->const_vol_env_flag = (flags >> 1) & 1;
+}
+
+static void state_get_apu(StateReader *reader, APU *apu)
+{
+    apu->status = state_get8(reader);
+    apu->ctr_register = state_get8(reader);
+
+    state_get_pulse(reader, &apu->pulse1);
+    state_get_pulse(reader, &apu->pulse2);
+
+    apu->triangle.timer_low = state_get8(reader);
+    apu->triangle.timer_high = state_get8(reader);
+    apu->triangle.timer_period = state_get16(reader);
+    apu->triangle.length_counter = state_get8(reader);
+    apu->triangle.linear_counter = state_get8(reader);
+    apu->triangle.output = state_get8(reader);
+    apu->triangle.length_halt = state_get8(reader) & 1;
+
+    apu->noise.timer_low = state_get8(reader);
+    apu->noise.timer_high = state_get8(reader);
+    apu->noise.envelope = state_get8(reader);
+    apu->noise.period = state_get8(reader);
+    apu->noise.length_counter = state_get8(reader);
+    apu->noise.linear_shift = state_get8(reader);
+    apu->noise.output = state_get8(reader);
+
+    unsigned char flags = state_get8(reader);
+
+    apu->noise.length_halt = flags & 1;
+    apu->noise.constant = (flags >> 1) & 1;
+    apu->noise.mode = (flags >> 2) & 1;
+
+    apu->dmc.timer_low = state_get8(reader);
+    apu->dmc.timer_high = state_get8(reader);
+    apu->dmc.memory_reader = state_get8(reader);
+    apu->dmc.sample_buffer = state_get8(reader);
+    apu->dmc.output_unit = state_get8(reader);
+    apu->dmc.rate = state_get8(reader);
+    apu->dmc.output = state_get8(reader);
+    apu->dmc.sample_addr = state_get16(reader);
+    apu->dmc.sample_length = state_get16(reader);
+    apu->dmc.loop = state_get8(reader) & 1;
+}
+
+size_t state_save(const CPU *cpu, uint8_t *buffer, size_t capacity)
+{
+    const Bus       *bus = &cpu->bus;
+    const PPU       *ppu = &bus->ppu;
+    StateWriter     writer = { buffer, 0, capacity, 0, false };
+
+    state_put(&writer, "NESS", 4);
+    state_put8(&writer, STATE_VERSION);
+
+    state_begin_chunk(&writer, CHUNK_CPU);
+    state_put_cpu(&writer, cpu);
+    state_end_chunk(&writer);
+
+    state_begin_chunk(&writer, CHUNK_RAM);
+    state_put(&writer, bus->cpu_vram, sizeof(bus->cpu_vram));
+    state_end_chunk(&writer);
+
+    state_begin_chunk(&writer, CHUNK_JOYPADS);
+    state_put_joypads(&writer, bus);
+    state_end_chunk(&writer);
+
+    state_begin_chunk(&writer, CHUNK_PPU);
+    state_put_ppu(&writer, ppu);
+    state_end_chunk(&writer);
+
+    // the upper 2 KB only hold anything on four-screen carts
+    state_begin_chunk(&writer, CHUNK_VRAM);
+    state_put(&writer, ppu->vram, ppu->mirroring == FOUR_SCREEN ? 4096 : 2048);
+    state_end_chunk(&writer);
+
+    state_begin_chunk(&writer, CHUNK_OAM);
+    state_put(&writer, ppu->oam_data, sizeof(ppu->oam_data));
+    state_end_chunk(&writer);
+
+    state_begin_chunk(&writer, CHUNK_PALETTE);
+    state_put(&writer, ppu->palette_table, sizeof(ppu->palette_table));
+    state_end_chunk(&writer);
+
+    state_begin_chunk(&writer, CHUNK_SCANLINES);
+
+    for (int line = 0; line < FRAME_HEIGHT; line++)
+    {
+        state_put16(&writer, ppu->scanlines[line].v);
+        state_put8(&writer, ppu->scanlines[line].x);
+        state_put8(&writer, ppu->scanlines[line].ctrl);
+        state_put8(&writer, ppu->scanlines[line].mask);
+    }
+
+    state_end_chunk(&writer);
+
+    // oam may have changed since the frame started, keep what it was evaluated from
+    state_begin_chunk(&writer, CHUNK_SPRITES);
+    state_put(&writer, ppu->sprite_y, sizeof(ppu->sprite_y));
+    state_put8(&writer, ppu->sprite_height);
+    state_end_chunk(&writer);
+
+    state_begin_chunk(&writer, CHUNK_APU);
+    state_put_apu(&writer, &bus->apu);
+    state_end_chunk(&writer);
+
+    if (state_has_chunk(cpu, CHUNK_CHR_RAM))
+    {
+        state_begin_chunk(&writer, CHUNK_CHR_RAM);
+        state_put(&writer, ppu->chr_ram, CHR_RAM_SIZE);
+        state_end_chunk(&writer);
+    }
+
+    if (state_has_chunk(cpu, CHUNK_PRG_RAM))
+    {
+        state_begin_chunk(&writer, CHUNK_PRG_RAM);
+        state_put(&writer, bus->rom.prg_ram, PRG_RAM_SIZE);
+        state_end_chunk(&writer);
+    }
+
+    if (state_has_chunk(cpu, CHUNK_MAPPER))
+    {
+        state_begin_chunk(&writer, CHUNK_MAPPER);
+        state_put(&writer, &bus->mapper, sizeof(Mapper));
+        state_end_chunk(&writer);
+    }
+
+    if (writer.overflow)
+    {
+        printf("state buffer too small!\n");
+        return 0;
+    }
+
+    return writer.length;
+}
+
+bool state_load(CPU *cpu, const uint8_t *buffer, size_t length)
+{
+    StateReader     reader = { buffer, length, 0 };
+    size_t          chunks[CHUNK_COUNT] = { 0 };
+    uint32_t        chunk_lengths[CHUNK_COUNT] = { 0 };
+
+    if (length < 5 || memcmp(buffer, "NESS", 4) != 0)
+    {
+        printf("not a save state!\n");
+        return false;
+    }
+
+    if (buffer[4] != STATE_VERSION)
+    {
+        printf("save state version %d not supported!\n", buffer[4]);
+        return false;
+    }
+
+    reader.pos = 5;
+
+    // check every chunk before anything is written, unknown ones are skipped
+    while (reader.pos + 8 <= length)
+    {
+        const uint8_t   *tag = &buffer[reader.pos];
+        
+        reader.pos += 4;
+
+        uint32_t        chunk_length = state_get32(&reader);
+
+        if (chunk_length > length - reader.pos)
+            break;
+
+        for (int chunk = 0; chunk < CHUNK_COUNT; chunk++)
+        {
+            if (memcmp(tag, CHUNK_TAGS[chunk], 4) == 0)
+            {
+                chunks[chunk] = reader.pos;
+                chunk_lengths[chunk] = chunk_length;
+            }
+        }
+
+        reader.pos += chunk_length;
+    }
+
+    if (reader.pos != length)
+    {
+        printf("save state is truncated!\n");
+        return false;
+    }
+
+    for (int chunk = 0; chunk < CHUNK_COUNT; chunk++)
+    {
+        if (!state_has_chunk(cpu, chunk))
+            continue;
+
+        if (!chunks[chunk] 
+        || (CHUNK_LENGTHS[chunk] && chunk_lengths[chunk] != CHUNK_LENGTHS[chunk]))
+        {
+            printf("save state chunk %.4s is missing or damaged!\n", CHUNK_TAGS[chunk]);
+            return false;
+        }
+    }
+
+    if (chunk_lengths[CHUNK_VRAM] != 2048 && chunk_lengths[CHUNK_VRAM] != 4096)
+    {
+        printf("save state chunk VRAM is damaged!\n");
+        return false;
+    }
+
+    if (buffer[chunks[CHUNK_PPU] + 7] > SINGLE_SCREEN_UPPER)
+    {
+        printf("save state mirroring is not valid!\n");
+        return false;
+    }
+
+    Bus *bus = &cpu->bus;
+    PPU *ppu = &bus->ppu;
+
+    reader.pos = chunks[CHUNK_CPU];
+    cpu->register_a = state_get8(&reader);
+    cpu->register_x = state_get8(&reader);
+    cpu->register_y = state_get8(&reader);
+    cpu->stack_pointer = state_get8(&reader);
+    cpu->status = state_get8(&reader);
+    cpu->program_counter = state_get16(&reader);
+    cpu->cycles = state_get32(&reader);
+    bus->cycles = state_get32(&reader);
+
+    reader.pos = chunks[CHUNK_RAM];
+    state_get(&reader, bus->cpu_vram, sizeof(bus->cpu_vram));
+
+    reader.pos = chunks[CHUNK_JOYPADS];
+
+    for (Joypad *joypad = &bus->joypad1; joypad <= &bus->joypad2; joypad++)
+    {
+        joypad->strobe = state_get8(&reader);
+        joypad->index = state_get8(&reader);
+        joypad->button_status = state_get8(&reader);
+    }
+
+    reader.pos = chunks[CHUNK_PPU];
+    ppu->ctrl = state_get8(&reader);
+    ppu->mask = state_get8(&reader);
+    ppu->status = state_get8(&reader);
+    ppu->oam_addr = state_get8(&reader);
+    ppu->internal_data_buf = state_get8(&reader);
+    ppu->latch = state_get8(&reader);
+
+    unsigned char flags = state_get8(&reader);
+
+    ppu->nmi_interrupt = flags & 1;
+    ppu->nmi_write = (flags >> 1) & 1;
+    ppu->w = (flags >> 2) & 1;
+    ppu->sprite_no_limit = (flags >> 3) & 1;
+
+    enum Mirroring mirroring = state_get8(&reader);
+
+    ppu->scanline = state_get16(&reader);
+    ppu->cycles = state_get16(&reader);
+    ppu->v = state_get16(&reader);
+    ppu->t = state_get16(&reader);
+    ppu->x = state_get8(&reader);
+    ppu->sprite_0_hit_dot = state_get16(&reader);
+
+    memset(ppu->vram, 0, sizeof(ppu->vram));
+    reader.pos = chunks[CHUNK_VRAM];
+    state_get(&reader, ppu->vram, chunk_lengths[CHUNK_VRAM]);
+
+    reader.pos = chunks[CHUNK_OAM];
+    state_get(&reader, ppu->oam_data, sizeof(ppu->oam_data));
+
+    reader.pos = chunks[CHUNK_PALETTE];
+    state_get(&reader, ppu->palette_table, sizeof(ppu->palette_table));
+
+    reader.pos = chunks[CHUNK_SCANLINES];
+
+    for (int line = 0; line < FRAME_HEIGHT; line++)
+    {
+        ppu->scanlines[line].v = state_get16(&reader);
+        ppu->scanlines[line].x = state_get8(&reader);
+        ppu->scanlines[line].ctrl = state_get8(&reader);
+        ppu->scanlines[line].mask = state_get8(&reader);
+    }
+
+    reader.pos = chunks[CHUNK_SPRITES];
+    state_get(&reader, ppu->sprite_y, sizeof(ppu->sprite_y));
+    ppu->sprite_height = state_get8(&reader);
+
+    reader.pos = chunks[CHUNK_APU];
+    state_get_apu(&reader, &bus->apu);
+
+    if (state_has_chunk(cpu, CHUNK_CHR_RAM))
+    {
+        reader.pos = chunks[CHUNK_CHR_RAM];
+        state_get(&reader, ppu->chr_ram, CHR_RAM_SIZE);
+    }
+
+    if (state_has_chunk(cpu, CHUNK_PRG_RAM))
+    {
+        reader.pos = chunks[CHUNK_PRG_RAM];
+        state_get(&reader, bus->rom.prg_ram, PRG_RAM_SIZE);
+    }
+
+    if (state_has_chunk(cpu, CHUNK_MAPPER))
+    {
+        reader.pos = chunks[CHUNK_MAPPER];
+        state_get(&reader, &bus->mapper, sizeof(Mapper));
+    }
+
+    bus->dirty_pages = 0xFF;
+    bus->prg_ram_dirty_pages = 0xFFFFFFFF;
+    ppu->dirty_pages = PPU_ALL_PAGES;
+    ppu->chr_dirty_pages = 0xFFFFFFFF;
+
+    // rebuild the banks and what the PPU derives from its memory
+    mapper_apply(bus);
+    ppu_set_mirroring(ppu, mirroring);
+    ppu_update_attributes(ppu);
+    memset(ppu->bg_pattern_dirty, 0, sizeof(ppu->bg_pattern_dirty));
+    ppu_evaluate_sprite_lines(ppu);
+
+    return true;
+}
+
+uint64_t state_hash(const CPU *cpu)
+{
+    const Bus       *bus = &cpu->bus;
+    const PPU       *ppu = &bus->ppu;
+    uint8_t         registers[128];
+    StateWriter     writer = { registers, 0, sizeof(registers), 0, false };
+    uint64_t        hash;
+
+    state_put_cpu(&writer, cpu);
+    state_put_joypads(&writer, bus);
+    state_put_ppu(&writer, ppu);
+    state_put_apu(&writer, &bus->apu);
+
+    // each block seeds the next, the per-line latches only feed the picture
+    hash = hash_xxh64(registers, writer.length, 0);
+    hash = hash_xxh64(bus->cpu_vram, sizeof(bus->cpu_vram), hash);
+    hash = hash_xxh64(ppu->vram, ppu->mirroring == FOUR_SCREEN ? 4096 : 2048, hash);
+    hash = hash_xxh64(ppu->oam_data, sizeof(ppu->oam_data), hash);
+    hash = hash_xxh64(ppu->palette_table, sizeof(ppu->palette_table), hash);
+
+    if (ppu->chr_ram)
+        hash = hash_xxh64(ppu->chr_ram, CHR_RAM_SIZE, hash);
+
+    if (bus->rom.prg_ram)
+        hash = hash_xxh64(bus->rom.prg_ram, PRG_RAM_SIZE, hash);
+
+    if (bus->rom.mapper)
+        hash = hash_xxh64(&bus->mapper, sizeof(Mapper), hash);
+
+    return hash;
+}
@@ -0,0 +1,19 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include "emu.h"
+#include "hash.h"
+
+#define STATE_VERSION       1
+
+// room for every chunk of a four-screen cart with chr and prg ram, NROM
+// states are much smaller
+#define STATE_MAX_SIZE      32768
+
+size_t state_save(const CPU *cpu, uint8_t *buffer, size_t capacity);
+bool state_load(CPU *cpu, const uint8_t *buffer, size_t length);
+
+// 64-bit hash of everything a save state holds that can change while running
+uint64_t state_hash(const CPU *cpu);
+
+#endif
@@ -0,0 +1,99 @@
+#include <time.h>
+#include "pipeline.h"
+
+#define TEST_FRAMES 5000
+
+FrameQueue queue;
+atomic_bool producer_done;
+
+static void spin(long nanoseconds)
+{
+    struct timespec ts = { 0, nanoseconds };
+
+    nanosleep(&ts, NULL);
+}
+
+static void *producer(void *data)
+{
+    long delay = *(long*)data;
+
+    for (uint32_t n = 1; n <= TEST_FRAMES; n++)
+    {
+        Frame *frame = frame_queue_back(&queue);
+
+        // every pixel carries the frame number so a torn frame shows up
+        for (int i = 0; i < FRAME_LENGTH; i++)
+            frame->data[i] = n;
+
+        frame_queue_publish(&queue);
+
+        if (delay)
+            spin(delay);
+    }
+
+    atomic_store(&producer_done, true);
+    return NULL;
+}
+
+static bool run(long produce_delay, long consume_delay)
+{
+    pthread_t       thread;
+    uint32_t        last = 0;
+    unsigned int    shown = 0, 
+                    torn = 0, 
+                    stale = 0;
+
+    frame_queue_init(&queue);
+    atomic_store(&producer_done, false);
+
+    pthread_create(&thread, NULL, producer, &produce_delay);
+
+    while (!atomic_load(&producer_done) || last < TEST_FRAMES)
+    {
+        Frame *frame = frame_queue_front(&queue);
+
+        if (frame)
+        {
+            uint32_t n = frame->data[0];
+
+            for (int i = 1; i < FRAME_LENGTH; i++)
+            {
+                if (frame->data[i] != n)
+                {
+                    torn++;
+                    break;
+                }
+            }
+
+            if (n < last)
+                stale++;
+            else if (n > last)
+                shown++;
+
+            last = n;
+        }
+
+        if (consume_delay)
+            spin(consume_delay);
+    }
+
+    pthread_join(thread, NULL);
+
+    printf("produce %ldns consume %ldns: %u frames shown, %u torn, %u out of order, last %u\n", 
+            produce_delay, consume_delay, shown, torn, stale, last);
+
+    return !torn && !stale && last == TEST_FRAMES;
+}
+
+int main(int argc, char const *argv[])
+{
+    bool ok = true;
+
+    ok &= run(0, 0);
+    ok &= run(0, 200000);
+    ok &= run(200000, 0);
+    ok &= run(50000, 70000);
+
+    printf(ok ? "frame queue ok\n" : "frame queue FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,272 @@
+#include "nes.h"
+
+#define PRG_BANKS 16
+#define CHR_BANKS 128
+
+// every 8 KB prg bank starts with its number and is NOPs after that, and
+// every 1 KB chr bank is filled with its number, so a window shows which
+// bank it points at
+static unsigned char rom[16 + PRG_BANKS * 0x2000 + CHR_BANKS * 0x400];
+
+static NesMachine *cart_open(unsigned char mapper, unsigned char prg_banks, unsigned char chr_banks)
+{
+    static const unsigned char header[16] = { 'N', 'E', 'S', 0x1A };
+
+    unsigned char   *prg = &rom[16],
+                    *chr = &prg[prg_banks * 0x2000];
+
+    memcpy(rom, header, sizeof(header));
+    rom[4] = prg_banks / 2;
+    rom[5] = chr_banks / 8;
+    rom[6] = mapper << 4;
+    rom[7] = mapper & 0xF0;
+
+    for (int bank = 0; bank < prg_banks; bank++)
+    {
+        memset(&prg[bank * 0x2000], 0xEA, 0x2000);
+        prg[bank * 0x2000] = bank;
+    }
+
+    for (int bank = 0; bank < chr_banks; bank++)
+        memset(&chr[bank * 0x400], bank, 0x400);
+
+    // nmi and reset at $E001, irq at $E080, all in the last bank
+    static const unsigned char vectors[6] = { 0x01, 0xE0, 0x01, 0xE0, 0x80, 0xE0 };
+
+    memcpy(&prg[prg_banks * 0x2000 - 6], vectors, sizeof(vectors));
+
+    NesMachine *nes = nes_create();
+
+    if (!nes_load(nes, rom, 16 + prg_banks * 0x2000 + chr_banks * 0x400))
+    {
+        nes_destroy(nes);
+        return NULL;
+    }
+
+    return nes;
+}
+
+static bool prg_is(Bus *bus, unsigned short addr, unsigned char bank)
+{
+    return cpu_mem_read(bus, addr) == bank;
+}
+
+// count windows from window on show banks in a row from bank
+static bool chr_is(Bus *bus, int window, unsigned char bank, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (bus->ppu.chr_banks[window + i][0] != (unsigned char)(bank + i))
+            return false;
+    }
+
+    return true;
+}
+
+static bool check(bool ok, const char *name)
+{
+    printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// one register through the five bit serial port, low bit first
+static void mmc1_write_serial(Bus *bus, unsigned short addr, unsigned char value)
+{
+    for (int i = 0; i < 5; i++)
+        cpu_mem_write(bus, addr, (value >> i) & 1);
+}
+
+static bool test_mmc1()
+{
+    NesMachine *nes = cart_open(1, PRG_BANKS, 32);
+
+    if (!nes)
+        return check(false, "mmc1");
+
+    Bus     *bus = &nes_cpu(nes)->bus;
+    bool    ok = true;
+
+    // powers on with the last 16 KB fixed at $C000
+    ok &= prg_is(bus, 0x8000, 0) && prg_is(bus, 0xC000, 14) && prg_is(bus, 0xE000, 15);
+
+    mmc1_write_serial(bus, 0xE000, 3);
+    ok &= prg_is(bus, 0x8000, 6) && prg_is(bus, 0xA000, 7) && prg_is(bus, 0xC000, 14);
+
+    // 4 KB chr banks and vertical mirroring
+    mmc1_write_serial(bus, 0x8000, 0x1E);
+    mmc1_write_serial(bus, 0xA000, 2);
+    mmc1_write_serial(bus, 0xC000, 5);
+    ok &= bus->ppu.mirroring == VERTICAL;
+    ok &= chr_is(bus, 0, 8, 4) && chr_is(bus, 4, 20, 4);
+
+    // 8 KB chr without the low bit, $8000 fixed to the first bank
+    mmc1_write_serial(bus, 0x8000, 0x0B);
+    ok &= bus->ppu.mirroring == HORIZONTAL;
+    ok &= chr_is(bus, 0, 8, 8);
+    ok &= prg_is(bus, 0x8000, 0) && prg_is(bus, 0xC000, 6);
+
+    // a reset write drops the bits so far and fixes the last bank again
+    cpu_mem_write(bus, 0xE000, 1);
+    cpu_mem_write(bus, 0xE000, 0x80);
+    mmc1_write_serial(bus, 0xE000, 1);
+    ok &= prg_is(bus, 0x8000, 2) && prg_is(bus, 0xC000, 14);
+
+    // single screen
+    mmc1_write_serial(bus, 0x8000, 0x0D);
+    ok &= bus->ppu.mirroring == SINGLE_SCREEN_UPPER;
+
+    nes_destroy(nes);
+    return check(ok, "mmc1");
+}
+
+static bool test_uxrom()
+{
+    NesMachine *nes = cart_open(2, PRG_BANKS, 8);
+
+    if (!nes)
+        return check(false, "uxrom");
+
+    Bus     *bus = &nes_cpu(nes)->bus;
+    bool    ok = prg_is(bus, 0x8000, 0) && prg_is(bus, 0xC000, 14);
+
+    cpu_mem_write(bus, 0x8000, 5);
+    ok &= prg_is(bus, 0x8000, 10) && prg_is(bus, 0xA000, 11) && prg_is(bus, 0xC000, 14);
+
+    // any address in $8000-$FFFF
+    cpu_mem_write(bus, 0xFFF0, 3);
+    ok &= prg_is(bus, 0x8000, 6) && prg_is(bus, 0xE000, 15);
+
+    nes_destroy(nes);
+    return check(ok, "uxrom");
+}
+
+static bool test_cnrom()
+{
+    NesMachine *nes = cart_open(3, 4, 32);
+
+    if (!nes)
+        return check(false, "cnrom");
+
+    Bus     *bus = &nes_cpu(nes)->bus;
+    bool    ok = chr_is(bus, 0, 0, 8);
+
+    cpu_mem_write(bus, 0x8000, 2);
+    ok &= chr_is(bus, 0, 16, 8) && prg_is(bus, 0x8000, 0);
+
+    nes_destroy(nes);
+    return check(ok, "cnrom");
+}
+
+static bool test_mmc3_banks()
+{
+    NesMachine *nes = cart_open(4, PRG_BANKS, CHR_BANKS);
+
+    if (!nes)
+        return check(false, "mmc3 banks");
+
+    Bus     *bus = &nes_cpu(nes)->bus;
+    bool    ok = prg_is(bus, 0x8000, 0) && prg_is(bus, 0xA000, 1)
+                && prg_is(bus, 0xC000, 14) && prg_is(bus, 0xE000, 15);
+
+    cpu_mem_write(bus, 0x8000, 6);
+    cpu_mem_write(bus, 0x8001, 3);
+    cpu_mem_write(bus, 0x8000, 7);
+    cpu_mem_write(bus, 0x8001, 9);
+    ok &= prg_is(bus, 0x8000, 3) && prg_is(bus, 0xA000, 9);
+
+    // prg mode 1 swaps $8000 and $C000
+    cpu_mem_write(bus, 0x8000, 0x46);
+    ok &= prg_is(bus, 0x8000, 14) && prg_is(bus, 0xC000, 3);
+
+    // R0 is 2 KB without its low bit, R2 is 1 KB
+    cpu_mem_write(bus, 0x8000, 0);
+    cpu_mem_write(bus, 0x8001, 9);
+    cpu_mem_write(bus, 0x8000, 2);
+    cpu_mem_write(bus, 0x8001, 0x21);
+    ok &= chr_is(bus, 0, 8, 2) && chr_is(bus, 4, 0x21, 1);
+
+    // chr inversion swaps the pattern table halves
+    cpu_mem_write(bus, 0x8000, 0x80);
+    ok &= chr_is(bus, 4, 8, 2) && chr_is(bus, 0, 0x21, 1);
+
+    cpu_mem_write(bus, 0xA000, 1);
+    ok &= bus->ppu.mirroring == HORIZONTAL;
+
+    cpu_mem_write(bus, 0xA000, 0);
+    ok &= bus->ppu.mirroring == VERTICAL;
+
+    nes_destroy(nes);
+    return check(ok, "mmc3 banks");
+}
+
+// runs the PPU a cpu cycle, three dots, at a time until it is at or up to
+// two dots past dot on line
+static void tick_to(Bus *bus, unsigned short line, unsigned short dot)
+{
+    while (bus->ppu.scanline != line || bus->ppu.cycles < dot)
+        bus_tick(bus, 1);
+}
+
+static bool test_mmc3_irq()
+{
+    NesMachine *nes = cart_open(4, PRG_BANKS, CHR_BANKS);
+
+    if (!nes)
+        return check(false, "mmc3 irq");
+
+    CPU     *cpu = nes_cpu(nes);
+    Bus     *bus = &cpu->bus;
+    bool    ok = true;
+
+    // nothing is counted while rendering is off
+    cpu_mem_write(bus, 0xC000, 2);
+    cpu_mem_write(bus, 0xC001, 0);
+    cpu_mem_write(bus, 0xE001, 0);
+    tick_to(bus, 10, 0);
+    ok &= !bus->mapper.irq_pending && bus->mapper.irq_reload;
+
+    // the first clock at dot 260 reloads the latch, two more reach 0
+    cpu_mem_write(bus, 0x2001, 0x18);
+    tick_to(bus, 12, 250);
+    ok &= !bus->mapper.irq_pending && bus->mapper.irq_counter == 1;
+
+    tick_to(bus, 12, 262);
+    ok &= bus->mapper.irq_pending;
+
+    // held until acknowledged, and taken once I is clear
+    tick_to(bus, 14, 0);
+    ok &= bus->mapper.irq_pending;
+
+    cpu->status &= ~Interrupt_Disable_Flag;
+    cpu_interpret(cpu);
+    ok &= (cpu->program_counter & 0xFFF0) == 0xE080;
+
+    // $E000 acknowledges and disables, the counter keeps going
+    cpu_mem_write(bus, 0xE000, 0);
+    ok &= !bus->mapper.irq_pending;
+
+    tick_to(bus, 20, 0);
+    ok &= !bus->mapper.irq_pending;
+
+    // enabled again, the next time it reaches 0
+    cpu_mem_write(bus, 0xE001, 0);
+    tick_to(bus, 21, 262);
+    ok &= bus->mapper.irq_pending;
+
+    nes_destroy(nes);
+    return check(ok, "mmc3 irq");
+}
+
+int main(int argc, char const *argv[])
+{
+    bool ok = true;
+
+    ok &= test_mmc1();
+    ok &= test_uxrom();
+    ok &= test_cnrom();
+    ok &= test_mmc3_banks();
+    ok &= test_mmc3_irq();
+
+    printf(ok ? "mappers ok\n" : "mappers FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,401 @@
+#include <signal.h>
+#include <unistd.h>
+#include "nes.h"
+#include "rewind.h"
+
+#define PRG_LENGTH 0x4000
+#define CHR_LENGTH 0x2000
+
+// NROM cart with one 16 KB prg bank, the vectors sit at its end since the
+// bank shows up at $C000 too
+static unsigned char rom[16 + PRG_LENGTH + CHR_LENGTH];
+
+// flags is header byte 6, 0b10 for a cart with battery backed ram
+static void rom_build(const unsigned char code[], size_t length, unsigned char flags)
+{
+    static const unsigned char header[16] = { 'N', 'E', 'S', 0x1A, 1, 1 };
+
+    memset(rom, 0, sizeof(rom));
+    memcpy(rom, header, sizeof(header));
+    rom[6] = flags;
+    memcpy(&rom[16], code, length);
+
+    // nmi, reset and irq all start at $8000
+    for (int i = PRG_LENGTH - 6; i < PRG_LENGTH; i += 2)
+    {
+        rom[16 + i] = 0x00;
+        rom[16 + i + 1] = 0x80;
+    }
+}
+
+static bool check(bool ok, const char *name)
+{
+    printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// a game that never enables NMI still has frames
+static bool test_nmi_off()
+{
+    // JMP $8000 with $2000 left at 0
+    static const unsigned char code[] = { 0x4C, 0x00, 0x80 };
+
+    NesMachine *nes = nes_create();
+
+    rom_build(code, sizeof(code), 0);
+    nes_load(nes, rom, sizeof(rom));
+
+    for (int i = 0; i < 3; i++)
+        nes_step(nes, false);
+
+    bool ok = nes_frame_count(nes) == 3;
+
+    nes_destroy(nes);
+    return check(ok, "step with nmi off");
+}
+
+// counts in the cart's ram and copies the count to ram and the sound
+// registers, so a run leaves something behind for the next one
+static void rom_build_counter()
+{
+    static const unsigned char code[] = {
+        0xEE, 0x00, 0x60,   // INC $6000
+        0xAD, 0x00, 0x60,   // LDA $6000
+        0x85, 0x00,         // STA $00
+        0x8D, 0x02, 0x40,   // STA $4002
+        0x4C, 0x00, 0x80,   // JMP $8000
+    };
+
+    rom_build(code, sizeof(code), 0b10);
+}
+
+// switching off and on has to give the same machine as loading the rom
+static bool test_power_cycle()
+{
+    NesMachine  *nes = nes_create(),
+                *fresh = nes_create();
+
+    rom_build_counter();
+    nes_load(nes, rom, sizeof(rom));
+
+    for (int i = 0; i < 5; i++)
+        nes_step(nes, false);
+
+    // and a second pulse channel the counter never touches
+    for (unsigned short addr = 0x4004; addr < 0x4008; addr++)
+        bus_mem_write(&nes_cpu(nes)->bus, addr, 0xFF);
+
+    nes_power_cycle(nes);
+    nes_load(fresh, rom, sizeof(rom));
+
+    for (int i = 0; i < 5; i++)
+    {
+        nes_step(nes, false);
+        nes_step(fresh, false);
+    }
+
+    CPU     *a = nes_cpu(nes),
+            *b = nes_cpu(fresh);
+
+    bool    ok = !memcmp(a->bus.cpu_vram, b->bus.cpu_vram, sizeof(a->bus.cpu_vram))
+                && !memcmp(a->bus.rom.prg_ram, b->bus.rom.prg_ram, PRG_RAM_SIZE)
+                && !memcmp(&a->bus.apu, &b->bus.apu, sizeof(a->bus.apu))
+                && a->program_counter == b->program_counter && a->cycles == b->cycles;
+
+    nes_destroy(nes);
+    nes_destroy(fresh);
+    return check(ok, "power cycle");
+}
+
+// the reset button leaves the cart's ram alone, switching off does not
+static bool test_reset()
+{
+    NesMachine *nes = nes_create();
+
+    rom_build_counter();
+    nes_load(nes, rom, sizeof(rom));
+
+    for (int i = 0; i < 5; i++)
+        nes_step(nes, false);
+
+    unsigned char *prg_ram = nes_cpu(nes)->bus.rom.prg_ram,
+                  count = prg_ram[0];
+
+    nes_reset(nes);
+    bool ok = count && prg_ram[0] == count;
+
+    nes_power_cycle(nes);
+    ok &= !prg_ram[0];
+
+    nes_destroy(nes);
+    return check(ok, "reset keeps cart ram");
+}
+
+// the counter rom when file is NULL
+static NesMachine *machine_open(const char *file)
+{
+    NesMachine *nes = nes_create();
+
+    if (!file)
+        rom_build_counter();
+
+    if (file ? !nes_load_file(nes, file) : !nes_load(nes, rom, sizeof(rom)))
+    {
+        nes_destroy(nes);
+        return NULL;
+    }
+
+    return nes;
+}
+
+static void step_frames(NesMachine *nes, int frames)
+{
+    for (int i = 0; i < frames; i++)
+        nes_step(nes, false);
+}
+
+// the whole machine as a save state, which is what runs are compared by
+static size_t snapshot(NesMachine *nes, unsigned char *state)
+{
+    return nes_save_state(nes, state, STATE_MAX_SIZE);
+}
+
+static bool same_state(NesMachine *nes, const unsigned char *state, size_t length)
+{
+    static unsigned char now[STATE_MAX_SIZE];
+
+    return length && snapshot(nes, now) == length && !memcmp(now, state, length);
+}
+
+typedef bool (*Restore)(NesMachine *nes, void *data);
+
+// runs on for a number of frames, puts the machine back with restore and
+// runs the same frames again, which has to end in the same state
+static bool runs_on_alike(NesMachine *nes, Restore restore, void *data, int frames)
+{
+    static unsigned char expected[STATE_MAX_SIZE];
+
+    step_frames(nes, frames);
+
+    size_t length = snapshot(nes, expected);
+
+    if (!restore(nes, data))
+        return false;
+
+    step_frames(nes, frames);
+    return same_state(nes, expected, length);
+}
+
+typedef struct SavedState
+{
+    unsigned char   data[STATE_MAX_SIZE];
+    size_t          length;
+} SavedState;
+
+static bool restore_state(NesMachine *nes, void *data)
+{
+    SavedState *state = data;
+
+    return nes_load_state(nes, state->data, state->length);
+}
+
+// a loaded state has to run on exactly like the machine it was saved from,
+// and a damaged one has to be turned down without touching the machine
+static bool test_save_load(const char *file)
+{
+    static SavedState state, damaged;
+
+    NesMachine *nes = machine_open(file);
+
+    if (!nes)
+        return check(false, "save and load");
+
+    step_frames(nes, 10);
+    state.length = snapshot(nes, state.data);
+
+    bool ok = runs_on_alike(nes, restore_state, &state, 20)
+                && restore_state(nes, &state);
+
+    damaged = state;
+    damaged.length--;
+    ok &= !restore_state(nes, &damaged) && same_state(nes, state.data, state.length);
+
+    damaged = state;
+    damaged.data[4]++;
+    ok &= !restore_state(nes, &damaged) && same_state(nes, state.data, state.length);
+
+    nes_destroy(nes);
+    return check(ok, "save and load");
+}
+
+#define REWIND_FRAMES 100
+
+static unsigned char    pushed[REWIND_FRAMES][STATE_MAX_SIZE];
+static size_t           pushed_lengths[REWIND_FRAMES];
+
+// a snapshot every frame, more than the entry table starts with, and the
+// state each was taken from for comparing
+static void push_frames(NesMachine *nes, Rewind *rewind)
+{
+    for (int i = 0; i < REWIND_FRAMES; i++)
+    {
+        nes_step(nes, false);
+        rewind_push(rewind, nes);
+        pushed_lengths[i] = snapshot(nes, pushed[i]);
+    }
+}
+
+static bool same_as_pushed(NesMachine *nes, int frame)
+{
+    return same_state(nes, pushed[frame], pushed_lengths[frame]);
+}
+
+// stepping back K snapshots lands on the state from K frames ago, and
+// running K frames from there gets back to the newest one
+static bool test_rewind(const char *file)
+{
+    static Rewind rewind;
+
+    NesMachine *nes = machine_open(file);
+
+    if (!nes || !rewind_init(&rewind, 1 << 20, 1))
+        return check(false, "rewind");
+
+    push_frames(nes, &rewind);
+
+    bool ok = true;
+
+    for (int i = 0; i < 12; i++)
+        ok &= rewind_step_back(&rewind, nes);
+
+    ok &= same_as_pushed(nes, REWIND_FRAMES - 1 - 12);
+
+    step_frames(nes, 12);
+    ok &= same_as_pushed(nes, REWIND_FRAMES - 1);
+
+    rewind_free(&rewind);
+    nes_destroy(nes);
+    return check(ok, "rewind");
+}
+
+// a ring too small for every snapshot drops the oldest ones, and the ones
+// it keeps still step back to the right frames
+static bool test_rewind_evict(const char *file)
+{
+    static Rewind rewind;
+
+    NesMachine *nes = machine_open(file);
+
+    if (!nes || !rewind_init(&rewind, 1 << 20, 1))
+        return check(false, "rewind eviction");
+
+    // a third of the room every snapshot takes
+    push_frames(nes, &rewind);
+
+    size_t capacity = rewind_used(&rewind) / 3;
+
+    rewind_free(&rewind);
+    nes_destroy(nes);
+
+    if (!(nes = machine_open(file)) || !rewind_init(&rewind, capacity, 1))
+        return check(false, "rewind eviction");
+
+    push_frames(nes, &rewind);
+
+    bool    ok = rewind_used(&rewind) <= capacity;
+    int     kept = 0;
+
+    while (rewind_step_back(&rewind, nes))
+        ok &= same_as_pushed(nes, REWIND_FRAMES - 1 - ++kept);
+
+    // the oldest snapshot left is where it stays
+    ok &= kept > 0 && kept < REWIND_FRAMES - 1;
+    ok &= same_as_pushed(nes, REWIND_FRAMES - 1 - kept);
+
+    printf("%d of %d snapshots kept in %zu bytes\n", kept, REWIND_FRAMES - 1, capacity);
+
+    rewind_free(&rewind);
+    nes_destroy(nes);
+    return check(ok, "rewind eviction");
+}
+
+static bool restore_clone(NesMachine *nes, void *data)
+{
+    return nes_restore(nes, data);
+}
+
+// a restored clone runs on like the machine it was taken from, and like
+// a second machine that was never rolled back
+static bool test_clone(const char *file)
+{
+    static unsigned char expected[STATE_MAX_SIZE];
+
+    NesMachine  *nes = machine_open(file),
+                *other = machine_open(file);
+
+    if (!nes || !other)
+        return check(false, "clone");
+
+    step_frames(nes, 10);
+
+    NesClone    *clone = nes_clone(nes);
+    bool        ok = clone && runs_on_alike(nes, restore_clone, clone, 20);
+    size_t      length = snapshot(nes, expected);
+
+    step_frames(other, 30);
+    ok &= same_state(other, expected, length);
+
+    nes_clone_free(clone);
+    nes_destroy(nes);
+    nes_destroy(other);
+    return check(ok, "clone");
+}
+
+static void timeout(int signal)
+{
+    printf("nes tests timed out\n");
+    fflush(stdout);
+    _exit(1);
+}
+
+int main(int argc, char const *argv[])
+{
+    bool ok = true;
+
+    // the counter rom for checks that need a file, e.g. nes_batch
+    if (argc == 3 && !strcmp(argv[1], "-w"))
+    {
+        FILE *f = fopen(argv[2], "wb");
+
+        if (!f)
+            return 1;
+
+        rom_build_counter();
+        fwrite(rom, 1, sizeof(rom), f);
+        fclose(f);
+        return 0;
+    }
+
+    // a step that never finishes is a failure, not a hung build
+    signal(SIGALRM, timeout);
+    alarm(30);
+
+    ok &= test_nmi_off();
+    ok &= test_power_cycle();
+    ok &= test_reset();
+
+    // a rom that renders and one that only touches ram and sound
+    const char *files[] = { "nestest.nes", NULL };
+
+    for (int i = 0; i < 2; i++)
+    {
+        printf("%s\n", files[i] ? files[i] : "counter rom");
+        ok &= test_save_load(files[i]);
+        ok &= test_rewind(files[i]);
+        ok &= test_rewind_evict(files[i]);
+        ok &= test_clone(files[i]);
+    }
+
+    printf(ok ? "nes ok\n" : "nes FAILED\n");
+    return ok ? 0 : 1;
+}
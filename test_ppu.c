@@ -0,0 +1,195 @@
+#include "pipeline.h"
+
+#define TEST_FRAMES 8
+
+PPU ppu;
+RenderPipeline pipeline;
+Frame cached, fresh, direct;
+unsigned char chr[0x2000];
+
+static unsigned char random_byte()
+{
+    static unsigned int seed = 1;
+
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+// the way a game writes through $2006 and $2007
+static void ppu_write(unsigned short addr, unsigned char data)
+{
+    ppu_write_to_ppu_addr(&ppu, addr >> 8);
+    ppu_write_to_ppu_addr(&ppu, addr & 0xFF);
+    ppu_write_to_data(&ppu, data);
+}
+
+// random patterns, nametables, palette and sprites with rendering on
+static void ppu_setup()
+{
+    // a cart with chr ram, so pattern rows can be written like the rest
+    ppu_load(&ppu, chr, chr, sizeof(chr), VERTICAL);
+
+    for (int i = 0; i < sizeof(chr); i++)
+        chr[i] = random_byte();
+
+    for (int i = 0; i < 0x800; i++)
+        ppu_write(0x2000 + i, random_byte());
+
+    for (int i = 0; i < 32; i++)
+        ppu_write(0x3F00 + i, random_byte() & 0x3F);
+
+    for (int i = 0; i < 256; i++)
+        ppu.oam_data[i] = random_byte();
+
+    ppu.mask = BACKGROUND_SHOW | SPRITES_SHOW | BACKGROUND_LEFTMOST | SPRITES_LEFTMOST;
+}
+
+// also draws every line into direct as soon as it is latched, which is
+// what rendering on the emulation thread would show
+static void tick_to_line(short line)
+{
+    while (ppu.scanline != line)
+    {
+        short before = ppu.scanline;
+
+        ppu_tick(&ppu, 1);
+
+        if (ppu.scanline != before && ppu.scanline < FRAME_HEIGHT)
+            ppu_render_scanline(&ppu, direct.data, ppu.scanline);
+    }
+}
+
+static void scroll(unsigned char x, unsigned char y)
+{
+    ppu_write_to_scroll(&ppu, x);
+    ppu_write_to_scroll(&ppu, y);
+}
+
+// a frame with a scroll split at line 120, up to the next vblank
+static void run_frame(int n)
+{
+    ppu_write_to_ctrl(&ppu, n & 1);
+    scroll(random_byte(), random_byte() % 240);
+
+    tick_to_line(120);
+    scroll(random_byte(), 0);
+
+    tick_to_line(241);
+}
+
+// a few tiles, attributes and pattern rows change in vblank
+static void change_frame()
+{
+    for (int i = 0; i < 24; i++)
+        ppu_write(0x2000 + (random_byte() << 3 | (random_byte() & 0b111)) % 0x800, random_byte());
+
+    for (int i = 0; i < 4; i++)
+        ppu_write(0x23C0 + (random_byte() & 0x3F), random_byte());
+
+    for (int i = 0; i < 8; i++)
+    {
+        unsigned short addr = (random_byte() << 5 | (random_byte() & 0x1F)) & 0x1FFF;
+
+        ppu_write(addr, random_byte());
+    }
+}
+
+// each frame is drawn through the cache as the changes since the last one
+// left it, then again from nothing, which rebuilds the cache
+static bool test_cache()
+{
+    unsigned int mismatched = 0;
+
+    ppu_setup();
+
+    for (int n = 0; n < TEST_FRAMES; n++)
+    {
+        run_frame(n);
+
+        ppu_render(&ppu, &cached);
+        ppu_invalidate_background(&ppu);
+        ppu_render(&ppu, &fresh);
+
+        if (memcmp(&cached, &fresh, sizeof(Frame)))
+            mismatched++;
+
+        change_frame();
+        tick_to_line(0);
+    }
+
+    printf("%u of %d cached frames differ from a fresh render\n", mismatched, TEST_FRAMES);
+    return !mismatched;
+}
+
+// tiles, palette and scroll written halfway down the screen, $2006 writes
+// move the scroll as well
+static void change_mid_frame()
+{
+    for (int i = 0; i < 8; i++)
+        ppu_write(0x2000 + (random_byte() << 3 | (random_byte() & 0b111)) % 0x800, random_byte());
+
+    ppu_write(0x3F00 + (random_byte() & 0x1F), random_byte());
+    scroll(random_byte(), random_byte() % 240);
+}
+
+// the render thread replays the frame's writes at the lines they were made
+// on, which has to come out the same as drawing each line live
+static bool test_replay()
+{
+    unsigned int mismatched = 0;
+
+    // the frontend starts the thread in vblank, with the first frame ahead
+    ppu_setup();
+    tick_to_line(241);
+
+    if (!pipeline_start(&pipeline, &ppu))
+        return false;
+
+    for (int n = 0; n < TEST_FRAMES; n++)
+    {
+        change_frame();
+
+        for (int i = 0; i < 16; i++)
+        {
+            unsigned char addr = random_byte();
+
+            ppu.oam_data[addr] = random_byte();
+            ppu_log_write(&ppu, PPU_LOG_OAM, addr, ppu.oam_data[addr]);
+        }
+
+        ppu_write_to_ctrl(&ppu, n & 1);
+        scroll(random_byte(), random_byte() % 240);
+
+        tick_to_line(0);
+        tick_to_line(90);
+        change_mid_frame();
+        tick_to_line(170);
+        change_mid_frame();
+        tick_to_line(241);
+
+        pipeline_submit(&pipeline, &ppu, true);
+
+        // wait for the frame just handed over to be drawn
+        while (!pipeline_frame_ready(&pipeline))
+            sched_yield();
+
+        if (memcmp(pipeline_frame(&pipeline), &direct, sizeof(Frame)))
+            mismatched++;
+    }
+
+    pipeline_stop(&pipeline, &ppu);
+
+    printf("%u of %d replayed frames differ from a live render\n", mismatched, TEST_FRAMES);
+    return !mismatched;
+}
+
+int main(int argc, char const *argv[])
+{
+    bool ok = true;
+
+    ok &= test_cache();
+    ok &= test_replay();
+
+    printf(ok ? "ppu ok\n" : "ppu FAILED\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include "vec.h"
+
+typedef struct VecWorker
+{
+    struct NesVecEnv    *envs;
+    unsigned int        first, last;
+    pthread_t           thread;
+} VecWorker;
+
+struct NesVecEnv
+{
+    NesMachine          **machines;
+    unsigned int        count;
+
+    uint8_t             *observations;
+
+    // the calling thread runs the first slice itself
+    VecWorker           *workers;
+    unsigned int        worker_count;
+    pthread_barrier_t   start, done;
+
+    // arguments of the step in progress, read by every worker
+    const uint8_t       *actions;
+    unsigned int        frames_per_step;
+    bool                quit;
+};
+
+static void vec_observe(NesMachine *nes, uint8_t *obs)
+{
+    const uint32_t *pixels = nes_frame(nes)->data;
+
+    // average each 2x2 block, luma weights 77/150/29 out of 256
+    for (int y = 0; y < NES_VEC_OBS_HEIGHT; y++)
+    {
+        const uint32_t *row = &pixels[(y << 1) * FRAME_WIDTH];
+
+        for (int x = 0; x < NES_VEC_OBS_WIDTH; x++)
+        {
+            const uint32_t  quad[4] = { row[x << 1], row[(x << 1) + 1], 
+                                        row[FRAME_WIDTH + (x << 1)], row[FRAME_WIDTH + (x << 1) + 1] };
+            unsigned int    sum = 0;
+
+            for (int i = 0; i < 4; i++)
+                sum += 77 * (quad[i] & 0xFF) + 150 * ((quad[i] >> 8) & 0xFF) + 29 * ((quad[i] >> 16) & 0xFF);
+
+            obs[y * NES_VEC_OBS_WIDTH + x] = sum >> 10;
+        }
+    }
+
+    memcpy(&obs[NES_VEC_OBS_PIXELS], nes_cpu(nes)->bus.cpu_vram, 2048);
+}
+
+static void vec_run_slice(NesVecEnv *envs, unsigned int first, unsigned int last)
+{
+    for (unsigned int i = first; i < last; i++)
+    {
+        NesMachine *nes = envs->machines[i];
+
+        nes_set_buttons(nes, envs->actions[i], 0);
+
+        // only the frame that gets observed is drawn
+        for (unsigned int n = 1; n <= envs->frames_per_step; n++)
+            nes_step(nes, n == envs->frames_per_step);
+
+        vec_observe(nes, &envs->observations[(size_t)i * NES_VEC_OBS_SIZE]);
+    }
+}
+
+static void *vec_worker_run(void *data)
+{
+    VecWorker *worker = data;
+    NesVecEnv *envs = worker->envs;
+
+    while (true)
+    {
+        pthread_barrier_wait(&envs->start);
+
+        if (envs->quit)
+            break;
+
+        vec_run_slice(envs, worker->first, worker->last);
+        pthread_barrier_wait(&envs->done);
+    }
+
+    return NULL;
+}
+
+NesVecEnv *nes_vec_create(const char *rom_file, unsigned int count, unsigned int threads, uint8_t *observations)
+{
+    if (!count)
+        return NULL;
+
+    if (threads == 0 || threads > count)
+        threads = count;
+
+    NesVecEnv *envs = calloc(1, sizeof(NesVecEnv));
+
+    envs->count = count;
+    envs->observations = observations;
+    envs->machines = calloc(count, sizeof(NesMachine*));
+
+    // one copy of the rom is shared by every instance
+    for (unsigned int i = 0; i < count; i++)
+    {
+        envs->machines[i] = nes_create();
+
+        if (i == 0 ? !nes_load_file(envs->machines[0], rom_file) 
+                    : !nes_load_shared(envs->machines[i], envs->machines[0]))
+        {
+            envs->count = i + 1;
+            nes_vec_destroy(envs);
+            return NULL;
+        }
+    }
+
+    envs->worker_count = threads;
+    envs->workers = calloc(threads, sizeof(VecWorker));
+
+    pthread_barrier_init(&envs->start, NULL, threads);
+    pthread_barrier_init(&envs->done, NULL, threads);
+
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        VecWorker *worker = &envs->workers[i];
+
+        worker->envs = envs;
+        worker->first = count * i / threads;
+        worker->last = count * (i + 1) / threads;
+
+        if (i > 0)
+            pthread_create(&worker->thread, NULL, vec_worker_run, worker);
+    }
+
+    return envs;
+}
+
+void nes_vec_destroy(NesVecEnv *envs)
+{
+    if (envs->workers)
+    {
+        envs->quit = true;
+
+        if (envs->worker_count > 1)
+            pthread_barrier_wait(&envs->start);
+
+        for (unsigned int i = 1; i < envs->worker_count; i++)
+            pthread_join(envs->workers[i].thread, NULL);
+
+        pthread_barrier_destroy(&envs->start);
+        pthread_barrier_destroy(&envs->done);
+        free(envs->workers);
+    }
+
+    // machines sharing the rom of the first one go before it
+    for (unsigned int i = envs->count; i-- > 0;)
+        nes_destroy(envs->machines[i]);
+
+    free(envs->machines);
+    free(envs);
+}
+
+void nes_vec_reset(NesVecEnv *envs, unsigned int env)
+{
+    nes_reset(envs->machines[env]);
+}
+
+void nes_vec_step(NesVecEnv *envs, const uint8_t actions[], unsigned int frames_per_step)
+{
+    envs->actions = actions;
+    envs->frames_per_step = frames_per_step ? frames_per_step : 1;
+
+    if (envs->worker_count > 1)
+        pthread_barrier_wait(&envs->start);
+
+    vec_run_slice(envs, envs->workers[0].first, envs->workers[0].last);
+
+    if (envs->worker_count > 1)
+        pthread_barrier_wait(&envs->done);
+}
+
+NesMachine *nes_vec_machine(NesVecEnv *envs, unsigned int env)
+{
+    return envs->machines[env];
+}
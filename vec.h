@@ -0,0 +1,24 @@
+#ifndef VEC_H
+#define VEC_H
+
+#include "nes.h"
+
+// observation of one instance: a greyscale frame at half resolution
+// followed by a copy of cpu_vram
+#define NES_VEC_OBS_WIDTH   128
+#define NES_VEC_OBS_HEIGHT  120
+#define NES_VEC_OBS_PIXELS  (NES_VEC_OBS_WIDTH * NES_VEC_OBS_HEIGHT)
+#define NES_VEC_OBS_SIZE    (NES_VEC_OBS_PIXELS + 2048)
+
+typedef struct NesVecEnv NesVecEnv;
+
+// observations must hold count * NES_VEC_OBS_SIZE bytes and stays owned by the caller
+NesVecEnv *nes_vec_create(const char *rom_file, unsigned int count, unsigned int threads, uint8_t *observations);
+void nes_vec_destroy(NesVecEnv *envs);
+
+void nes_vec_reset(NesVecEnv *envs, unsigned int env);
+void nes_vec_step(NesVecEnv *envs, const uint8_t actions[], unsigned int frames_per_step);
+
+NesMachine *nes_vec_machine(NesVecEnv *envs, unsigned int env);
+
+#endif